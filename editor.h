@@ -8,12 +8,587 @@
  * - Save functionality (Ctrl+S)
  * - Multi-line text management
  * - Automatic scrolling and viewport management
+ * - Line index sidecars for huge files, kept while in use
+ * - Read-only pager mode (-R) that never copies the file onto the heap
+ * - Hex view (-x) with in-place byte overwrites for binary files
+ * - Chunked storage for very long lines
+ * - Optional soft wrap backed by an incremental wrap index
+ * - UTF-8 input and rendering with an ASCII fast path
+ * - Tab expansion and caret notation for control characters
+ * - Idle-time scheduler for deferred work
+ * - Periodic heap compaction after long editing sessions
+ * - Heap accounting with a memory report (Ctrl+G, or SIGUSR1 to stderr)
+ * - Optional memory budget (TEXT_EDITOR_MEM_LIMIT, in MiB) that spills cold
+ *   lines to a temporary file
+ * - Selection with cut/copy/paste through a copy-on-write clipboard
+ * - Multiple cursors, edited together in one pass per line
+ * - Rectangular block selection with column cut/copy/paste and insert
+ * - Named marks and bookmarks that follow their lines through edits
+ * - Sort, unique and reverse over lines, sorting on several threads
+ * - Filtering lines through a shell command over streaming pipes
+ * - Headless batch mode (-b) applying an edit script to many files
+ * - Ex command line with ranges: substitute, delete, move and global
+ * - Diff view of the buffer against the file on disk (Ctrl+D)
+ * - Per-line content hashes: a modified indicator, skipped and incremental
+ *   saves, and a confirmation before quitting with unsaved changes
+ * - Code folding by indentation or brackets (Ctrl+F)
+ * - Bracket index for matching (Ctrl+]) and enclosing scope (Ctrl+U) jumps
+ * - Completion of words from the buffer (Ctrl+P) backed by an incremental
+ *   word index
+ *
+ * Build: cc -pthread -o main main.c -lncursesw
  */
 
 #ifndef EDITOR_H
 #define EDITOR_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <regex.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/** Estimated malloc header bytes per live heap block */
+#define MEM_HEADER sizeof(size_t)
+/** Number of named marks, one per letter a-z */
+#define MARK_NAMES 26
+/** Bytes of short lines gathered into one write to the spill file */
+#define SPILL_BLOCK (64 * 1024)
+/** Most short lines gathered into one write to the spill file */
+#define SPILL_BATCH 1024
+/** Most lines one spill pass looks at, bounding its cost per key */
+#define SPILL_MAX_VISIT 65536
+/** Lines loaded between two budget checks while a file is read */
+#define SPILL_CHECK_LINES 4096
+/** Screens above and below the cursor that are never spilled */
+#define SPILL_HOT_SCREENS (IDLE_WARM_SCREENS + 1)
+
+/** Bytes of file output buffered between writes when saving */
+#define SAVE_BUFFER (256 * 1024)
+
+/** Lines at least this long are stored as chunks instead of one string */
+#define LONGLINE_MIN (64 * 1024)
+/** Capacity in bytes of each chunk of a long line */
+#define LONGLINE_CHUNK 4096
+
+/** LineInfo flag: the line contains only ASCII bytes */
+#define LINE_ASCII 0x1
+/** LineInfo flag: only printable ASCII, so each byte is one screen column */
+#define LINE_PLAIN 0x2
+/** LineInfo flag: the text lives in the spill file, not in memory */
+#define LINE_SPILLED 0x4
+/** LineInfo flag: LineInfo.hash holds line_hash of the current text */
+#define LINE_HASHED 0x8
+/** LineInfo flag: LineInfo.brackets summarizes the current text */
+#define LINE_BRACKETS 0x10
+/** ChunkInfo flag: ChunkInfo.hash holds poly_bytes of the chunk */
+#define CHUNK_HASHED 0x1
+/** ChunkInfo flag: ChunkInfo.brackets summarizes the chunk */
+#define CHUNK_BRACKETS 0x2
+/** Lines summarized by each leaf of the bracket index */
+#define BRACKET_BLOCK 64
+/** LineInfo flag: LineInfo.words lists the words of the current text */
+#define LINE_WORDS 0x20
+/** Longest word kept in the completion index, in bytes */
+#define WORD_MAX 64
+/** Most words the completion index takes from one line */
+#define WORD_LINE_MAX 1024
+/** Unsorted new words the completion index collects before merging them */
+#define WORD_TAIL 256
+/** Unused words the completion index tolerates before it is rebuilt */
+#define WORD_DEAD_MIN 4096
+/** Most completions offered for one prefix */
+#define WORD_CHOICES 16
+/** Modulus of the polynomial hashes: the Mersenne prime 2^61 - 1 */
+#define POLY_PRIME ((1ULL << 61) - 1)
+/** Base of the polynomial hashes, below POLY_PRIME */
+#define POLY_BASE 0x0F3D5B79A2C4E687ULL
+/** Lines summarized by each leaf of the digest tree */
+#define DIGEST_BLOCK 64
+/** Distance between tab stops in screen columns */
+#define TAB_STOP 8
+/** Bytes between column checkpoints of a non-ASCII line */
+#define COLMAP_STEP 128
+/** Most wide characters drawn on one screen row */
+#define DRAW_MAX_CHARS 2048
+
+/** Files smaller than this are scanned directly and never cached */
+#define LINEIDX_MIN_SIZE (1 << 20)
+/** Number of file samples mixed into the cache key hash */
+#define LINEIDX_SAMPLES 16
+/** Size in bytes of each sample */
+#define LINEIDX_SAMPLE_LEN 4096
+/** Seconds a line index may go unused before it is deleted */
+#define LINEIDX_MAX_AGE (30 * 24 * 60 * 60)
+#define LINEIDX_MAGIC "TEDLIDX1"
+#define LINEIDX_VERSION 1
+
+/** The pager records the byte offset of every PAGER_CHECKPOINT-th line */
+#define PAGER_CHECKPOINT 4096
+/** Columns moved per horizontal scroll step in the pager */
+#define PAGER_HSCROLL 8
+/** Bytes behind the scan frontier kept resident after a long pager scan */
+#define PAGER_KEEP_BYTES (1 << 20)
+/** Text rows available to the pager (the last row is the status line) */
+#define PAGER_ROWS (LINES - 1)
+
+/** Longest time an idle task may run before input is checked again */
+#define IDLE_SLICE_US 500
+/** Lines the pager scan advances between clock checks */
+#define IDLE_SCAN_LINES 1024
+/** Screens of lines below the viewport whose layout is prepared when idle */
+#define IDLE_WARM_SCREENS 4
+/** Bytes of each long non-ASCII line whose column map is prepared when idle */
+#define IDLE_WARM_BYTES (64 * 1024)
+/** Edits between two idle compaction passes */
+#define IDLE_COMPACT_EDITS 4096
+/** Unused bytes a line allocation may keep before compaction shrinks it */
+#define COMPACT_SLACK 64
+/** Smallest capacity compaction shrinks the per-line arrays to */
+#define COMPACT_MIN_CAPACITY 256
+
+/** Lines below which a sort stays on the calling thread */
+#define SORT_PARALLEL_MIN (64 * 1024)
+/** Most threads a sort uses */
+#define SORT_MAX_THREADS 16
+/** Runs this short are insertion sorted */
+#define SORT_RUN 16
+
+/** Most pieces handed to one writev when feeding a filter */
+#define FILTER_IOV 256
+/** Bytes read from a filter's output at a time */
+#define FILTER_READ (64 * 1024)
+/** Bytes of spilled or long line text staged for one writev */
+#define FILTER_STAGE (64 * 1024)
+/** Range size from which lines fed to a filter move to the spill file */
+#define FILTER_SPILL_BYTES (64 * 1024 * 1024)
+
+/** Rows available to the diff view (the last row is the status line) */
+#define DIFF_ROWS (LINES - 1)
+/** Unchanged lines kept above a hunk when jumping to it */
+#define DIFF_CONTEXT 3
+/** Least number of edit steps a diff searches before taking a near split */
+#define DIFF_MIN_COST 4096
+/** Lines ahead whose hash table slot is prefetched while numbering lines */
+#define DIFF_PREFETCH 16
+
+/** Bytes shown per hex view row */
+#define HEX_WIDTH 16
+/** Rows available to the hex view (the last row is the status line) */
+#define HEX_ROWS (LINES - 1)
+/** Screen column of the hex digits for byte j of a row */
+#define HEX_COL(j) (12 + (j) * 3 + ((j) >= HEX_WIDTH / 2))
+/** Screen column where the ASCII pane of a row starts */
+#define HEX_ASCII_COL (HEX_COL(HEX_WIDTH) + 1)
+
+/**
+ * @enum MemKind
+ * @brief What a heap block is used for, for the memory report
+ *
+ * @value MEM_TEXT Line text, long line chunks and hex patches
+ * @value MEM_LINES The per-line arrays of the buffer
+ * @value MEM_INDEX Long line trees, column maps, wrap and pager indexes
+ * @value MEM_CACHE Render rows
+ * @value MEM_OTHER Short-lived scratch buffers
+ * @value MEM_NUM_KINDS Number of kinds
+ */
+typedef enum {
+  MEM_TEXT,
+  MEM_LINES,
+  MEM_INDEX,
+  MEM_CACHE,
+  MEM_OTHER,
+  MEM_NUM_KINDS
+} MemKind;
+
+/**
+ * @struct MemStats
+ * @brief Heap counters kept by the allocation wrappers
+ *
+ * Sizes are malloc_usable_size, so they include allocator rounding.
+ *
+ * @member bytes Live heap bytes of each kind
+ * @member blocks Live heap blocks of each kind
+ * @member allocs Allocation and reallocation calls since start-up
+ * @member keys Keys read by the main loop
+ * @member key_allocs Allocations made while handling those keys
+ * @member mark Value of allocs when the last key was read
+ */
+typedef struct {
+  size_t bytes[MEM_NUM_KINDS];
+  size_t blocks[MEM_NUM_KINDS];
+  unsigned long allocs;
+  unsigned long keys;
+  unsigned long key_allocs;
+  unsigned long mark;
+} MemStats;
+
+/**
+ * @struct PolyHash
+ * @brief Polynomial hash of a sequence, modulo POLY_PRIME
+ *
+ * hash is the sum of each element times POLY_BASE to the power of the
+ * number of elements after it, and pow is POLY_BASE to the length. Two
+ * pieces combine into the hash of their concatenation without looking at
+ * either again, so a hash over many pieces can be kept in a tree.
+ *
+ * @member hash The hash
+ * @member pow POLY_BASE to the number of elements
+ */
+typedef struct {
+  uint64_t hash;
+  uint64_t pow;
+} PolyHash;
+
+/**
+ * @struct BracketSum
+ * @brief Bracket nesting summary of a line or a run of lines
+ *
+ * Counting each opening bracket as +1 and each closing one as -1, outside
+ * double-quoted strings and character literals: delta is the total and lo
+ * the lowest running total (0 or less). The highest total of any suffix,
+ * which backward searches need, is delta - lo.
+ *
+ * @member delta Net change in nesting depth
+ * @member lo Lowest depth reached, relative to the start
+ */
+typedef struct {
+  int delta;
+  int lo;
+} BracketSum;
+
+/**
+ * @struct ChunkInfo
+ * @brief Cached summaries of one chunk of a LongLine
+ *
+ * An edit to the chunk clears its flags. The bracket summary depends on
+ * whether the chunk starts inside a string, and a character literal at its
+ * end looks at the bytes after it, so both are kept with the summary to
+ * tell whether it still applies.
+ *
+ * @member flags CHUNK_HASHED and CHUNK_BRACKETS for the caches that hold
+ * @member hash poly_bytes of the chunk, if CHUNK_HASHED
+ * @member brackets Bracket summary of the chunk, if CHUNK_BRACKETS
+ * @member state_in Bracket scanner state at the start of the chunk
+ * @member state_out Bracket scanner state at its end
+ * @member ahead_len Number of bytes in ahead
+ * @member ahead Up to three bytes that followed the chunk in the line
+ */
+typedef struct {
+  unsigned char flags;
+  unsigned char state_in, state_out;
+  unsigned char ahead_len;
+  char ahead[3];
+  PolyHash hash;
+  BracketSum brackets;
+} ChunkInfo;
+
+/**
+ * @struct LongLine
+ * @brief Chunked storage for a single very long line
+ *
+ * The line text is split into chunks of at most LONGLINE_CHUNK bytes. A
+ * Fenwick tree over the chunk lengths maps a column to its chunk in
+ * O(log n), so inserting or deleting a character only touches one chunk and
+ * a logarithmic number of tree nodes. Chunks are only split or dropped when
+ * they overflow or empty, which rebuilds the tree in O(number of chunks).
+ *
+ * @member chunks Array of chunk buffers, each LONGLINE_CHUNK bytes
+ * @member chunk_len Number of bytes used in each chunk
+ * @member fen Fenwick tree (1-based) over chunk_len
+ * @member chunk_info Cached hash and bracket summary of each chunk, so
+ * summaries of the line rescan only edited chunks
+ * @member num_chunks Number of chunks, always at least one
+ * @member cap Capacity of the chunk arrays
+ */
+typedef struct {
+  char **chunks;
+  size_t *chunk_len;
+  size_t *fen;
+  ChunkInfo *chunk_info;
+  size_t num_chunks;
+  size_t cap;
+} LongLine;
+
+/**
+ * @struct ColMap
+ * @brief Column/byte checkpoints for a line containing non-ASCII text
+ *
+ * Records the byte offset and screen column at character boundaries roughly
+ * every COLMAP_STEP bytes, so converting between the two needs a binary
+ * search plus decoding at most one step of text. The map is built lazily and
+ * only as far as lookups have needed; an edit drops the checkpoints after
+ * the edited position.
+ *
+ * @member byte Byte offset of each checkpoint (byte[0] is 0)
+ * @member col Screen column of each checkpoint (col[0] is 0)
+ * @member n Number of checkpoints
+ * @member cap Capacity of the checkpoint arrays
+ * @member done_byte Byte offset the map has been built up to
+ * @member done_col Screen column at done_byte
+ */
+typedef struct {
+  size_t *byte;
+  size_t *col;
+  size_t n;
+  size_t cap;
+  size_t done_byte;
+  size_t done_col;
+} ColMap;
+
+/**
+ * @struct Clip
+ * @brief Clipboard contents: the lines of a copied or cut range
+ *
+ * Whole lines inside the range are not copied: the clip takes over their
+ * text and, for a copy or a paste, the buffer lines keep pointing at it
+ * (LineInfo.shared) until they are edited, when line_own gives them a
+ * private copy. The clip is freed when the last reference goes.
+ *
+ * @member lines NUL-terminated text of each line, owned by the clip
+ * @member line_len Length of each line
+ * @member flags LINE_ASCII/LINE_PLAIN flags of each line
+ * @member num_lines Number of lines (1 for a range within one line)
+ * @member refs Buffer lines sharing the text, plus one while it is the
+ * clipboard
+ * @member block Non-zero for a column block: each line is one row of the
+ * rectangle, padded to its width, and is pasted into its own buffer line
+ */
+typedef struct Clip {
+  char **lines;
+  size_t *line_len;
+  unsigned *flags;
+  int num_lines;
+  int refs;
+  int block;
+} Clip;
+
+/**
+ * @struct LineInfo
+ * @brief Cached per-line metadata
+ *
+ * LINE_ASCII and LINE_PLAIN are computed when a line is created and kept up
+ * to date on edits. They may be clear for a long line that has lost its
+ * last special byte, which only costs the slower column lookup.
+ *
+ * ASCII lines that contain tabs or control characters get a render row: the
+ * line with tabs expanded to TAB_STOP and control characters written as ^X,
+ * so a screen column is also an index into the row. It is built when the
+ * line is first drawn and dropped whenever the line's text changes.
+ *
+ * A LINE_SPILLED line has its text in the buffer's spill file instead of
+ * lines/long_lines; line_fault reads it back before the text is used.
+ *
+ * The content hash and bracket summary are computed on first use and
+ * invalidated by buffer_damage. Both are computed before a line spills, so
+ * neither change checks nor bracket searches read a spilled line back.
+ *
+ * The word list survives buffer_damage, which only clears LINE_WORDS: the
+ * completion index needs the old words to uncount them.
+ *
+ * @member flags LINE_* flags
+ * @member colmap Column checkpoints, or NULL when not built (always NULL for
+ * LINE_PLAIN lines, where byte offset and column are equal)
+ * @member render Cached render row, or NULL when not built
+ * @member render_len Length of the render row (its width in columns)
+ * @member spill Offset of the text in the spill file, if LINE_SPILLED
+ * @member shared Clip whose text this line points at, or NULL if the line
+ * owns its text
+ * @member hash line_hash of the line, if LINE_HASHED
+ * @member brackets Bracket summary of the line, if LINE_BRACKETS
+ * @member words Completion index ids of the words the line was last indexed
+ * with, preceded by their number, or NULL if it had none
+ */
+typedef struct {
+  unsigned flags;
+  ColMap *colmap;
+  char *render;
+  size_t render_len;
+  off_t spill;
+  Clip *shared;
+  uint64_t hash;
+  BracketSum brackets;
+  uint32_t *words;
+} LineInfo;
+
+/**
+ * @struct Mark
+ * @brief A position anchored to a line, kept in the buffer's mark tree
+ *
+ * The tree is a treap ordered by line. Inserting or deleting lines shifts
+ * or collapses whole subtrees through lazy tags, so one edit costs
+ * O(log n) however many marks it moves. A node's line is only exact once
+ * the tags of its ancestors have been pushed down; mark_line does that.
+ *
+ * @member left Subtree of marks on earlier (or equal) lines
+ * @member right Subtree of marks on later (or equal) lines
+ * @member parent Parent node, or NULL at the root
+ * @member prio Random heap priority
+ * @member line Line of the mark
+ * @member x Byte offset in the line when the mark was set
+ * @member name Letter of a named mark, or 0 for a bookmark
+ * @member set Non-zero if the subtrees collapse onto line to
+ * @member to Line the subtrees collapse onto, before add
+ * @member add Line shift still owed to the subtrees
+ */
+typedef struct Mark {
+  struct Mark *left, *right, *parent;
+  int prio;
+  int line;
+  size_t x;
+  int name;
+  int set, to, add;
+} Mark;
+
+/**
+ * @struct Fold
+ * @brief A collapsed range of lines
+ *
+ * @member start Header line, which stays visible
+ * @member end Last hidden line
+ * @member kind Bracket that opened the region on the header line, or 0 for
+ * an indentation block
+ */
+typedef struct {
+  int start;
+  int end;
+  int kind;
+} Fold;
+
+/**
+ * @struct FoldSet
+ * @brief The collapsed folds of a buffer
+ *
+ * Folds are disjoint and sorted by line. hidden[i] counts the lines hidden
+ * by the folds before fold i, so mapping between buffer lines and screen
+ * rows is a binary search over the folds however many lines they hide.
+ * Inserted and deleted lines shift the folds along with the marks.
+ *
+ * Only lookups are logarithmic. Adding or removing a fold, or shifting
+ * folds for an insert or delete, moves the later folds and recounts hidden
+ * in O(f) for f folds. Folds are made one key at a time, so f stays small
+ * next to the number of lines.
+ *
+ * @member folds The folds in line order
+ * @member hidden Lines hidden before each fold, num + 1 entries
+ * @member num Number of folds
+ * @member cap Capacity of folds and hidden
+ * @member changed Set when folds change, until the wrap index catches up
+ */
+typedef struct {
+  Fold *folds;
+  int *hidden;
+  int num;
+  int cap;
+  int changed;
+} FoldSet;
+
+/**
+ * @struct DigestTree
+ * @brief Segment tree of polynomial hashes over blocks of line hashes
+ *
+ * Each leaf combines the hashes of DIGEST_BLOCK lines in order, so the root
+ * is an order-aware hash of the buffer. An edit inside a line recomputes
+ * one leaf and its O(log n) ancestors. Inserting or removing lines shifts
+ * every block after them, so the leaves from there on are recombined from
+ * the cached line hashes; the leaves before the change are kept.
+ *
+ * @member tree Hashes, 1-based, with leaf b at size + b
+ * @member size Number of leaves, a power of two
+ * @member num_lines Number of lines the leaves were laid out for
+ * @member dirty_lo First line whose leaf may be stale, INT_MAX when none
+ * @member dirty_hi Last line whose leaf may be stale
+ * @member fix_lo First leaf whose ancestors need recomputing, INT_MAX
+ * when none
+ * @member fix_hi Last leaf whose ancestors need recomputing
+ */
+typedef struct {
+  PolyHash *tree;
+  int size;
+  int num_lines;
+  int dirty_lo, dirty_hi;
+  int fix_lo, fix_hi;
+} DigestTree;
+
+/**
+ * @struct BracketIndex
+ * @brief Segment tree of bracket summaries over blocks of lines
+ *
+ * Each leaf joins the cached summaries of BRACKET_BLOCK lines, so finding
+ * the line that closes or opens a bracket far away descends the tree in
+ * O(log n) and then looks at one block. Edits mark lines dirty; the leaves
+ * over them are recomputed from the line summaries, rescanning only lines
+ * whose text changed, by the idle scheduler or before the next search.
+ *
+ * @member tree Summaries, 1-based, with leaf b at size + b
+ * @member size Number of leaves, a power of two
+ * @member num_lines Number of lines the leaves were laid out for
+ * @member dirty_lo First line whose leaf may be stale, INT_MAX when none
+ * @member dirty_hi Last line whose leaf may be stale
+ * @member fix_lo First leaf whose ancestors need recomputing, INT_MAX
+ * when none
+ * @member fix_hi Last leaf whose ancestors need recomputing
+ */
+typedef struct {
+  BracketSum *tree;
+  int size;
+  int num_lines;
+  int dirty_lo, dirty_hi;
+  int fix_lo, fix_hi;
+} BracketIndex;
+
+/**
+ * @struct Word
+ * @brief One distinct word in the completion index
+ *
+ * @member text The word, not NUL-terminated
+ * @member len Length of text in bytes
+ * @member count Occurrences in indexed lines; 0 once the last one is gone
+ * @member hash text_hash of the word
+ */
+typedef struct {
+  char *text;
+  uint32_t len;
+  uint32_t count;
+  uint64_t hash;
+} Word;
+
+/**
+ * @struct WordIndex
+ * @brief Occurrence counts of the words in the buffer, for completion
+ *
+ * A line that changes has its new words counted and the words it was last
+ * indexed with uncounted, so an edit costs the length of the line rather
+ * than of the file. Words are found by text through a hash table and by
+ * prefix through a binary search of the ids in text order. New words are
+ * appended unsorted and merged in once WORD_TAIL of them collect.
+ *
+ * Words whose count drops to zero keep their ids. Once there are more than
+ * WORD_DEAD_MIN of them and they outnumber the live ones, the index is
+ * dropped and built again.
+ *
+ * @member words Words by id
+ * @member num Number of words
+ * @member cap Capacity of words and order
+ * @member slots Hash table of id + 1, 0 for an empty slot
+ * @member num_slots Size of slots, a power of two (0 before the first word)
+ * @member order Every id, the first num_sorted of them in text order
+ * @member num_sorted Length of the sorted prefix of order
+ * @member dead Number of words with a count of zero
+ * @member dirty_lo First line that may need indexing, INT_MAX when none
+ * @member dirty_hi Last line that may need indexing
+ */
+typedef struct {
+  Word *words;
+  uint32_t num, cap;
+  uint32_t *slots;
+  uint32_t num_slots;
+  uint32_t *order;
+  uint32_t num_sorted;
+  uint32_t dead;
+  int dirty_lo, dirty_hi;
+} WordIndex;
 
 /**
  * @struct Buffer
@@ -21,17 +596,83 @@
  *
  * Stores all lines of the document with dynamic capacity expansion.
  * Each line is null-terminated and its length is tracked separately.
+ * Lines of LONGLINE_MIN bytes or more are kept in long_lines instead, with
+ * a NULL entry in lines; use buffer_line when contiguous text is needed.
+ *
+ * The buffer also records which lines were edited since the last call to
+ * buffer_damage_reset, so layout caches can update only what changed.
+ *
+ * The line hashes and digest of the file as last loaded or saved are kept
+ * to tell real changes from edits that were undone, and to rewrite only
+ * the part of the file after the first changed line.
  *
  * @member lines Array of pointers to individual lines
  * @member line_len Array of lengths for each line
+ * @member long_lines Chunked storage for each line, or NULL for plain lines
+ * @member info Cached metadata for each line
  * @member num_lines Number of lines currently in the buffer
  * @member capacity Maximum number of lines the buffer can hold
+ * @member damage_lo First line whose text changed (INT_MAX if none)
+ * @member damage_hi Last line whose text changed (-1 if none)
+ * @member reshaped Non-zero if lines were inserted or deleted
+ * @member reshape_lo First line at which lines were inserted or deleted
+ * (INT_MAX if none)
+ * @member edits Number of line edits since the buffer was created
+ * @member mem_limit Heap budget in bytes, 0 for none
+ * @member spill_fd Unlinked temporary file holding spilled lines, or -1
+ * @member spill_end Bytes written to the spill file so far
+ * @member spill_hand Next line the spill sweep looks at
+ * @member spill_error errno of a failed read of the spill file, 0 if none;
+ * once set, a line holds placeholder text and saving is refused
+ * @member scratch Copy of the last chunked or spilled line buffer_line read
+ * @member scratch_cap Allocated size of scratch
+ * @member marks Root of the mark tree, or NULL if there are no marks
+ * @member folds Collapsed folds
+ * @member brackets Bracket index
+ * @member words Word index for completion
+ * @member saved_hash Hash of each line of the file on disk
+ * @member saved_lines Number of lines in saved_hash
+ * @member saved_digest buffer_digest of the file on disk
+ * @member saved_edits Value of edits when the file was loaded or saved
+ * @member saved_st Status of the file when it was loaded or saved
+ * @member saved_exact Non-zero if saving the unedited buffer would write
+ * the file back byte for byte (it ends in a newline and has no NULs)
+ * @member digest Cached buffer_digest
+ * @member digest_edits Value of edits when digest was computed
+ * @member digest_tree Hashes of the line hashes that digest is made from
  */
 typedef struct {
   char **lines;
   size_t *line_len;
+  LongLine **long_lines;
+  LineInfo *info;
   int num_lines;
   int capacity;
+  int damage_lo;
+  int damage_hi;
+  int reshaped;
+  int reshape_lo;
+  unsigned long edits;
+  size_t mem_limit;
+  int spill_fd;
+  off_t spill_end;
+  int spill_hand;
+  int spill_error;
+  char *scratch;
+  size_t scratch_cap;
+  Mark *marks;
+  FoldSet folds;
+  BracketIndex brackets;
+  WordIndex words;
+  uint64_t *saved_hash;
+  int saved_lines;
+  uint64_t saved_digest;
+  unsigned long saved_edits;
+  struct stat saved_st;
+  int saved_exact;
+  uint64_t digest;
+  unsigned long digest_edits;
+  DigestTree digest_tree;
 } Buffer;
 
 /**
@@ -41,10 +682,10 @@ typedef struct {
  * Maintains both absolute cursor position (cx, cy) and the viewport offset
  * to support scrolling when the file is larger than the terminal.
  *
- * @member cx Cursor X position (column)
+ * @member cx Cursor X position (byte offset into the line)
  * @member cy Cursor Y position (row/line number)
- * @member rowoff Row offset for vertical scrolling
- * @member coloff Column offset for horizontal scrolling
+ * @member rowoff Row offset for vertical scrolling (a visual row in soft wrap)
+ * @member coloff Column offset for horizontal scrolling (0 in soft wrap)
  */
 typedef struct {
   int cx, cy;
@@ -52,177 +693,3688 @@ typedef struct {
 } Cursor;
 
 /**
- * @struct Editor
- * @brief Main editor state
+ * @struct WrapIndex
+ * @brief Maps buffer lines to visual rows when soft wrap is on
  *
- * Combines the buffer and cursor state with the filename reference.
+ * Each line takes its width in screen columns divided by the screen width,
+ * rounded up, and at least one row. The row counts are kept in a Fenwick
+ * tree so converting between a visual row and a buffer line is O(log n).
+ * Edited lines are updated in place from the buffer's damage range; a width
+ * change or inserted/deleted lines rebuild the tree in linear time. Folded
+ * lines count for no rows in the tree, but keep their count in rows.
  *
- * @member buffer The text content buffer
- * @member cursor Current cursor position and viewport state
- * @member filename Path to the open file
+ * @member enabled Non-zero when soft wrap is active
+ * @member width Screen width the index was built for
+ * @member num_lines Number of lines the index was built for
+ * @member cap Capacity of the rows and fen arrays
+ * @member rows Visual rows of each line
+ * @member fen Fenwick tree (1-based) over rows
  */
 typedef struct {
-  Buffer buffer;
-  Cursor cursor;
-  const char *filename;
-} Editor;
+  int enabled;
+  int width;
+  int num_lines;
+  int cap;
+  int *rows;
+  long *fen;
+} WrapIndex;
 
 /**
- * @brief Initializes a buffer with a given capacity
+ * @enum EditorMode
+ * @brief Which view is driving the editor
  *
- * Allocates memory for the lines and line_len arrays and sets the initial
- * state.
+ * @value MODE_EDIT Normal editing of a fully loaded buffer
+ * @value MODE_PAGER Read-only viewing straight from the file mapping
+ * @value MODE_HEX Hex/ASCII view with byte overwrites
+ * @value MODE_DIFF Diff of the buffer against the file on disk
+ */
+typedef enum { MODE_EDIT, MODE_PAGER, MODE_HEX, MODE_DIFF } EditorMode;
+
+/**
+ * @struct Pager
+ * @brief State of the read-only pager
  *
- * @param buf Pointer to the buffer to initialize
- * @param initial_capacity Initial number of lines the buffer can hold
+ * The pager displays the file straight from a read-only mapping and never
+ * copies text onto the heap. Line starts are found on demand around the
+ * viewport; the offset of every PAGER_CHECKPOINT-th line is recorded as the
+ * file is scanned from the start, so later jumps resume from the nearest
+ * checkpoint. Jumping to the end walks backwards from EOF and needs no scan,
+ * in which case the line number is unknown until the scan catches up.
+ *
+ * @member st Stat of the file, reused when upgrading to edit mode
+ * @member map Read-only mapping of the file (NULL if empty)
+ * @member size Size of the file in bytes
+ * @member top Byte offset of the first visible line
+ * @member top_line Line number of top, or -1 if not known
+ * @member coloff Column offset for horizontal scrolling
+ * @member checkpoints Start offsets of lines 0, N, 2N, ... (N =
+ * PAGER_CHECKPOINT)
+ * @member num_checkpoints Number of recorded checkpoints
+ * @member cp_cap Capacity of the checkpoints array
+ * @member scanned Start offset of the first line not yet scanned
+ * @member scanned_line Line number at scanned; the total once scanned == size
  */
-static void buffer_init(Buffer *buf, int initial_capacity);
+typedef struct {
+  struct stat st;
+  const char *map;
+  size_t size;
+  size_t top;
+  long top_line;
+  int coloff;
+  size_t *checkpoints;
+  size_t num_checkpoints;
+  size_t cp_cap;
+  size_t scanned;
+  long scanned_line;
+} Pager;
 
 /**
- * @brief Ensures the buffer has enough capacity for a required number of lines
+ * @struct HexPatch
+ * @brief A single overwritten byte in the hex view
  *
- * Dynamically expands the buffer capacity by doubling if necessary.
- * Uses exponential growth to minimize reallocation overhead.
+ * @member off Byte offset in the file
+ * @member byte New value of the byte
+ */
+typedef struct {
+  size_t off;
+  unsigned char byte;
+} HexPatch;
+
+/**
+ * @struct HexView
+ * @brief State of the hex view
  *
- * @param buf Pointer to the buffer
- * @param required Minimum number of lines needed
+ * The file is mapped read-only and rows are computed directly from byte
+ * offsets, so no line index is built and memory use does not depend on the
+ * file size. Overwritten bytes are kept in a sparse overlay sorted by offset
+ * and written back in place on save.
+ *
+ * @member fd Open file descriptor, read-write unless read_only is set
+ * @member read_only Non-zero if the file could only be opened for reading
+ * @member map Read-only shared mapping of the file (NULL if empty)
+ * @member size Size of the file in bytes
+ * @member cur Byte offset of the cursor
+ * @member nibble 0 for the high nibble, 1 for the low nibble
+ * @member ascii Non-zero when typing into the ASCII pane
+ * @member toprow Row number (offset / HEX_WIDTH) at the top of the screen
+ * @member patches Overwritten bytes, sorted by offset
+ * @member num_patches Number of overwritten bytes
+ * @member patch_cap Capacity of the patches array
+ * @member notice Message for the status line until the next key, or NULL
  */
-static void buffer_ensure_capacity(Buffer *buf, int required);
+typedef struct {
+  int fd;
+  int read_only;
+  const char *map;
+  size_t size;
+  size_t cur;
+  int nibble;
+  int ascii;
+  size_t toprow;
+  HexPatch *patches;
+  size_t num_patches;
+  size_t patch_cap;
+  const char *notice;
+} HexView;
 
 /**
- * @brief Frees all memory associated with a buffer
+ * @struct Caret
+ * @brief A cursor position used by multi-cursor editing
  *
- * Deallocates each line string, then the lines and line_len arrays.
+ * @member y Line index
+ * @member x Byte offset in the line
+ */
+typedef struct {
+  int y, x;
+} Caret;
+
+/**
+ * @struct Cursors
+ * @brief All cursors while more than one is active
  *
- * @param buf Pointer to the buffer to free
+ * Kept sorted by position without duplicates. The primary cursor mirrors
+ * Editor.cursor, which stays authoritative for scrolling.
+ *
+ * @member pos Cursor positions
+ * @member n Number of cursors; 0 or 1 means single-cursor editing
+ * @member cap Capacity of pos
+ * @member primary Index of the primary cursor in pos
  */
-static void buffer_free(Buffer *buf);
+typedef struct {
+  Caret *pos;
+  int n, cap;
+  int primary;
+} Cursors;
 
 /**
- * @brief Saves the buffer contents to the file
+ * @struct Splice
+ * @brief One edit of a batched line edit: remove bytes, then insert text
  *
- * Writes all lines from the buffer to the associated filename,
- * with each line followed by a newline character.
+ * @member pos Byte offset in the line before the batch is applied
+ * @member del Number of bytes removed at pos
+ */
+typedef struct {
+  size_t pos;
+  size_t del;
+} Splice;
+
+/**
+ * @struct Edit
+ * @brief One replacement of a batch applied by buffer_apply
  *
- * @param ed Pointer to the editor state
- * @return 1 on success, 0 on failure (file I/O error)
+ * @member y0 First line of the replaced range
+ * @member x0 Byte offset where the range starts
+ * @member y1 Last line of the replaced range
+ * @member x1 Byte offset where the range ends
+ * @member text Replacement text; '\n' starts a new line
+ * @member len Length of text in bytes
  */
-static int save_buffer(const Editor *ed);
+typedef struct {
+  int y0, y1;
+  size_t x0, x1;
+  const char *text;
+  size_t len;
+} Edit;
 
 /**
- * @brief Deletes a line from the buffer
+ * @struct SortSpec
+ * @brief How a sort compares lines, after sort(1)
  *
- * Removes the line at the specified index, shifting all subsequent lines up.
- * Frees the memory of the deleted line.
+ * @member numeric Compare the leading number of the key (-n)
+ * @member reverse Sort in descending order (-r)
+ * @member unique Keep only the first of lines with equal keys (-u)
+ * @member field Key starts at this 1-based field, 0 for the whole line (-k)
+ * @member sep Field separator, or 0 for runs of blanks (-t)
+ */
+typedef struct {
+  int numeric;
+  int reverse;
+  int unique;
+  int field;
+  char sep;
+} SortSpec;
+
+/**
+ * @struct SortLine
+ * @brief Sort handle of one line: its key and where the line came from
  *
- * @param buf Pointer to the buffer
- * @param at Index of the line to delete
+ * @member key Start of the key in the line's text (lexical sorts)
+ * @member num Value of the key (numeric sorts)
+ * @member len Length of the key in bytes (lexical sorts)
+ * @member line Index of the line relative to the sorted range
  */
-static void delete_line(Buffer *buf, int at);
+typedef struct {
+  union {
+    const char *key;
+    double num;
+  };
+  size_t len;
+  int line;
+} SortLine;
 
 /**
- * @brief Displays a message on the bottom status line
+ * @struct SortJob
+ * @brief A slice of a parallel sort handed to one thread
  *
- * Shows a message in reverse video on the last line of the terminal.
- * Useful for displaying status updates like "File saved successfully".
+ * @member buf Buffer being sorted (read only while threads run)
+ * @member spec Sort options
+ * @member a Handles of the slice
+ * @member tmp Scratch of the same size
+ * @member first Index of the slice's first handle in the range
+ * @member y0 First line of the sorted range
+ * @member n Number of handles in the slice
+ * @member mid Length of the left run when merging two sorted runs, or 0
+ * to build and sort the slice from scratch
+ */
+typedef struct {
+  const Buffer *buf;
+  const SortSpec *spec;
+  SortLine *a, *tmp;
+  int first, y0;
+  size_t n, mid;
+} SortJob;
+
+/**
+ * @struct FilterIn
+ * @brief Feed side of a filter: how far the range has been written
  *
- * @param msg The message string to display
+ * Lines written in full are moved to the spill file when spill is set, so
+ * feeding a large range frees its text as the output arrives; the range is
+ * still intact, if slower to read, should the command fail.
+ *
+ * @member y Line being written
+ * @member y1 Last line of the range
+ * @member off Bytes of line y written, counting its newline
+ * @member stage Staging area for spilled and long line text
+ * @member spill Non-zero to spill lines once written
+ * @member block Spill batch being gathered
+ * @member block_len Bytes in block
+ * @member pending Lines whose text is in block
+ * @member num_pending Number of pending lines
  */
-static void show_message(const char *msg);
+typedef struct {
+  int y, y1;
+  size_t off;
+  char *stage;
+  int spill;
+  char *block;
+  size_t block_len;
+  int pending[SPILL_BATCH];
+  int num_pending;
+} FilterIn;
 
 /**
- * @brief Redraws the editor viewport
+ * @struct FilterOut
+ * @brief Read side of a filter: the lines produced so far
  *
- * Clears the screen and renders visible lines based on the current viewport
- * offset. Handles both horizontal and vertical scrolling, positioning the
- * cursor correctly.
+ * @member lines Completed lines, each in an exactly sized allocation
+ * @member line_len Their lengths
+ * @member n Number of completed lines
+ * @member cap Capacity of lines and line_len
+ * @member part Start of a line whose newline has not arrived yet
+ * @member part_len Bytes in part
+ * @member part_cap Capacity of part
+ */
+typedef struct {
+  char **lines;
+  size_t *line_len;
+  int n, cap;
+  char *part;
+  size_t part_len, part_cap;
+} FilterOut;
+
+/**
+ * @struct EditBlock
+ * @brief Edits of a batch that chain through shared lines, rebuilt together
  *
- * @param ed Pointer to the editor state
+ * @member y0 First old line touched
+ * @member y1 Last old line touched
+ * @member first Index of the block's first edit
+ * @member n Number of edits in the block
+ * @member lines Number of lines the block becomes
  */
-static void redraw(const Editor *ed);
+typedef struct {
+  int y0, y1;
+  int first, n;
+  int lines;
+} EditBlock;
 
 /**
- * @brief Constrains cursor position within valid bounds and adjusts viewport
+ * @enum BatchOp
+ * @brief Command kinds of a batch script
  *
- * Ensures the cursor position is within the buffer and viewport limits.
- * Adjusts the viewport offset (rowoff, coloff) to keep the cursor visible
- * on screen by automatically scrolling when necessary.
+ * @value BATCH_GOTO Move the cursor to a line and column
+ * @value BATCH_INSERT Insert text at the cursor
+ * @value BATCH_DELETE Delete bytes after the cursor
+ * @value BATCH_REPLACE Delete bytes after the cursor, then insert text
+ * @value BATCH_SUBST Regex substitution over every line
+ * @value BATCH_LINES A line command, run through lines_command
+ * @value BATCH_EX An ex command, run through ex_command
+ */
+typedef enum {
+  BATCH_GOTO,
+  BATCH_INSERT,
+  BATCH_DELETE,
+  BATCH_REPLACE,
+  BATCH_SUBST,
+  BATCH_LINES,
+  BATCH_EX
+} BatchOp;
+
+/**
+ * @struct BatchCmd
+ * @brief One parsed command of a batch script
  *
- * @param ed Pointer to the editor state
+ * Scripts are parsed and their patterns compiled once, then run against
+ * every file.
+ *
+ * @member op Command kind
+ * @member line Script line, for error messages
+ * @member y Target line for BATCH_GOTO (0-based, -1 for the last line)
+ * @member x Target byte column for BATCH_GOTO
+ * @member n Byte count for BATCH_DELETE and BATCH_REPLACE
+ * @member text Text to insert, replacement template, or line command
+ * @member len Length of text in bytes
+ * @member re Compiled pattern for BATCH_SUBST
+ * @member global Non-zero to replace every match on a line, not the first
  */
-static void clamp_cursor(Editor *ed);
+typedef struct {
+  BatchOp op;
+  int line;
+  int y;
+  size_t x, n;
+  char *text;
+  size_t len;
+  regex_t re;
+  int global;
+} BatchCmd;
 
 /**
- * @brief Inserts a character at the cursor position
+ * @struct DiffHunk
+ * @brief A run of disk lines replaced by a run of buffer lines
  *
- * Inserts a character at the current cursor location, expanding the line as
- * needed. Handles memory reallocation and updates line length tracking.
+ * @member a0 First line on disk
+ * @member an Number of disk lines, 0 for a pure insertion
+ * @member b0 First line in the buffer
+ * @member bn Number of buffer lines, 0 for a pure deletion
+ * @member row Diff view row where the hunk starts in the current layout
+ */
+typedef struct {
+  int a0, an;
+  int b0, bn;
+  long row;
+} DiffHunk;
+
+/**
+ * @struct DiffSlot
+ * @brief Entry of the table that numbers distinct lines before a diff
  *
- * @param ed Pointer to the editor state
- * @param ch The character to insert, as an integer
+ * @member hash Hash of the line text
+ * @member rep First line with this text, which is also its number; -1 for
+ * an empty slot
  */
-static void insert_char(Editor *ed, int ch);
+typedef struct {
+  uint64_t hash;
+  int rep;
+} DiffSlot;
 
 /**
- * @brief Handles backspace (backward delete) operation
+ * @struct DiffCtx
+ * @brief Working state of a linear-space Myers diff
  *
- * Deletes the character before the cursor. If the cursor is at the beginning of
- * a line, merges the current line with the previous line.
+ * Lines are compared by number, equal numbers meaning equal text. The
+ * furthest-reaching x of each diagonal is kept in fd (searching forward)
+ * and bd (backward), indexed by x - y. Only lines that occur on both
+ * sides take part; ia and ib map them back to mark the changed lines.
  *
- * @param ed Pointer to the editor state
+ * @member a Line numbers of the old side
+ * @member b Line numbers of the new side
+ * @member fd Forward frontier by diagonal
+ * @member bd Backward frontier by diagonal
+ * @member max_cost Edit steps searched before settling for a near split
+ * @member ia Old line each entry of a came from
+ * @member ib New line each entry of b came from
+ * @member ca Per old line, set to 1 if it was removed
+ * @member cb Per new line, set to 1 if it was added
  */
-static void backspace(Editor *ed);
+typedef struct {
+  const int *a, *b;
+  int *fd, *bd;
+  int max_cost;
+  const int *ia, *ib;
+  char *ca, *cb;
+} DiffCtx;
 
 /**
- * @brief Handles delete (forward delete) operation
+ * @struct Completion
+ * @brief The completions offered by the last Ctrl+P
  *
- * Deletes the character at the cursor. If the cursor is at the end of a line,
- * merges the current line with the next line.
+ * Pressing Ctrl+P again straight after a completion replaces the inserted
+ * text with the next choice; after the last one the bare prefix comes back.
  *
- * @param ed Pointer to the editor state
+ * @member y Line of the completed word
+ * @member x Byte offset where the inserted text starts (after the prefix)
+ * @member edits Buffer edit count right after the last insertion, 0 when
+ * there is nothing to cycle through
+ * @member choice Index of the inserted choice, num for none
+ * @member num Number of choices
+ * @member len Length of the inserted text of each choice
+ * @member text Each choice with the prefix removed
  */
-static void delete_at_cursor(Editor *ed);
+typedef struct {
+  int y;
+  size_t x;
+  unsigned long edits;
+  int choice;
+  int num;
+  size_t len[WORD_CHOICES];
+  char text[WORD_CHOICES][WORD_MAX];
+} Completion;
 
 /**
- * @brief Inserts a newline at the cursor position, splitting the line
+ * @struct DiffView
+ * @brief State of the diff view
  *
- * Splits the current line at the cursor position:
- * - The content before the cursor remains on the current line
- * - The content after the cursor moves to a new line below
- * - The cursor moves to the beginning of the new line
+ * The disk copy is mapped read-only; rows are found from the hunks, so the
+ * view holds no per-row state whatever the file size.
  *
- * @param ed Pointer to the editor state
+ * @member map Read-only mapping of the file on disk (NULL if empty)
+ * @member size Size of the mapping in bytes
+ * @member off Start offset of each disk line, plus one past the last
+ * line's newline (real or implied)
+ * @member num_a Number of lines on disk
+ * @member hunks Differences in order
+ * @member num_hunks Number of hunks
+ * @member side Non-zero for side by side, zero for inline
+ * @member rows Number of rows in the current layout
+ * @member top Row at the top of the screen
+ * @member coloff Column offset for horizontal scrolling
  */
-static void insert_newline(Editor *ed);
+typedef struct {
+  const char *map;
+  size_t size;
+  size_t *off;
+  int num_a;
+  DiffHunk *hunks;
+  int num_hunks;
+  int side;
+  long rows;
+  long top;
+  int coloff;
+} DiffView;
 
 /**
- * @brief Loads a file into the editor buffer
+ * @struct View
+ * @brief What the last edit-mode redraw put on the screen
  *
- * Opens and reads the file line by line, storing each line in the buffer.
- * Initializes the cursor and viewport to the beginning of the file.
- * If the file is empty, creates a single empty line.
+ * When nothing but the text of some lines changed, redraw repaints only
+ * those rows.
  *
- * @param ed Pointer to the editor state
- * @param filename Path to the file to load
- * @return 1 on success, 0 on failure (file not found or I/O error)
+ * @member valid Zero when the screen must be redrawn in full
+ * @member rowoff Vertical scroll offset of the last redraw
+ * @member coloff Horizontal scroll offset of the last redraw
+ * @member lines Terminal height at the last redraw
+ * @member cols Terminal width at the last redraw
+ * @member sel Whether a selection was shown
+ * @member modified Whether the modified indicator was shown
  */
-static int load_file(Editor *ed, const char *filename);
+typedef struct {
+  int valid;
+  int rowoff, coloff;
+  int lines, cols;
+  int sel;
+  int modified;
+} View;
 
 /**
- * @brief Main entry point for the text editor
+ * @struct Selection
+ * @brief The range between the mark and the cursor
  *
- * Initializes ncurses, loads the file, and runs the main event loop.
- * Handles all user input and coordinates editor operations.
+ * @member active Non-zero while a mark is set
+ * @member my Line of the mark
+ * @member mx Byte offset of the mark in its line
+ * @member block Non-zero for a rectangle between the mark's and the
+ * cursor's screen columns rather than a stream of text
+ */
+typedef struct {
+  int active;
+  int my, mx;
+  int block;
+} Selection;
+
+/**
+ * @struct IdleState
+ * @brief Book-keeping for the idle scheduler
+ *
+ * @member pending Bit t is set while idle task t still reports work
+ * @member next Task to try first on the next slice (round robin)
+ * @member redraw Set by a task when the screen should be redrawn
+ * @member warm_line Next line whose layout the layout task will prepare
+ * @member warm_end Line at which the layout task stops
+ * @member compact_line Next line the compaction pass visits, -1 when idle
+ * @member compact_edits Buffer edit count when the last pass started
+ * @member reclaimed Bytes released so far by the current compaction pass
+ */
+typedef struct {
+  unsigned pending;
+  int next;
+  int redraw;
+  int warm_line;
+  int warm_end;
+  int compact_line;
+  unsigned long compact_edits;
+  size_t reclaimed;
+} IdleState;
+
+/**
+ * @struct Editor
+ * @brief Main editor state
+ *
+ * Combines the buffer and cursor state with the filename reference.
+ *
+ * @member buffer The text content buffer (unused in pager mode)
+ * @member cursor Current cursor position and viewport state
+ * @member filename Path to the open file
+ * @member mode Which view is active
+ * @member pager Pager state, valid in MODE_PAGER
+ * @member hex Hex view state, valid in MODE_HEX
+ * @member wrap Soft wrap index, used by edit mode when enabled
+ * @member idle Idle scheduler state
+ * @member sel Selection mark
+ * @member clip Clipboard, or NULL when nothing was copied yet
+ * @member multi Extra cursors for multi-cursor editing
+ * @member view Screen state for partial redraws
+ * @member named Named marks by letter, NULL where unset
+ * @member diff Diff view state, valid in MODE_DIFF
+ * @member complete Word completion state
+ */
+typedef struct {
+  Buffer buffer;
+  Cursor cursor;
+  const char *filename;
+  EditorMode mode;
+  Pager pager;
+  HexView hex;
+  WrapIndex wrap;
+  IdleState idle;
+  Selection sel;
+  Clip *clip;
+  Cursors multi;
+  View view;
+  Mark *named[MARK_NAMES];
+  DiffView diff;
+  Completion complete;
+} Editor;
+
+/**
+ * @struct IdleTask
+ * @brief A unit of deferred work run while the user is not typing
+ *
+ * The step function should do a bounded amount of work, returning before
+ * the deadline so that a key press is handled promptly.
+ *
+ * @member name Short name of the task
+ * @member step Runs one slice; returns 1 if work remains, 0 when finished
+ */
+typedef struct {
+  const char *name;
+  int (*step)(Editor *ed, long long deadline);
+} IdleTask;
+
+/**
+ * @struct LineIndexHeader
+ * @brief On-disk header of a cached line index
+ *
+ * A line index sidecar lives in $XDG_CACHE_HOME/text_editor (or
+ * ~/.cache/text_editor) and is named after the device and inode of the file
+ * it describes. The header is followed by payload_len bytes of LEB128 varints,
+ * one per line, each holding the distance from that line's start to the next
+ * line's start. The cache is only used when every key field still matches.
+ *
+ * @member magic LINEIDX_MAGIC, not NUL-terminated
+ * @member version LINEIDX_VERSION
+ * @member dev Device of the indexed file
+ * @member ino Inode of the indexed file
+ * @member size Size of the indexed file in bytes
+ * @member mtime_sec Modification time, seconds
+ * @member mtime_nsec Modification time, nanoseconds
+ * @member sample_hash Hash of sampled file contents (see lineidx_sample_hash)
+ * @member num_lines Number of varints in the payload
+ * @member payload_len Length of the varint payload in bytes
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t sample_hash;
+  uint64_t num_lines;
+  uint64_t payload_len;
+} LineIndexHeader;
+
+/**
+ * @brief Allocates heap memory and accounts for it
+ *
+ * @param kind What the block is used for
+ * @param n Number of bytes
+ * @return The new block
+ */
+static void *mem_alloc(MemKind kind, size_t n);
+
+/**
+ * @brief Resizes a heap block and accounts for the change
+ *
+ * @param kind What the block is used for; must match its allocation
+ * @param p Block to resize, or NULL to allocate
+ * @param n New size in bytes
+ * @return The resized block
+ */
+static void *mem_realloc(MemKind kind, void *p, size_t n);
+
+/**
+ * @brief Frees a heap block and accounts for it
+ *
+ * @param kind What the block is used for; must match its allocation
+ * @param p Block to free, or NULL
+ */
+static void mem_free(MemKind kind, void *p);
+
+/**
+ * @brief Returns the live heap bytes of all kinds
+ *
+ * @return Sum of MemStats bytes
+ */
+static size_t mem_total(void);
+
+/**
+ * @brief Formats a one-line memory summary for the status line
+ *
+ * @param out Destination buffer
+ * @param out_len Size of out
+ */
+static void mem_report(char *out, size_t out_len);
+
+/**
+ * @brief Writes the full memory report
+ *
+ * @param f Stream to write to
+ */
+static void mem_dump(FILE *f);
+
+/**
+ * @brief SIGUSR1 handler; requests a memory report dump
+ *
+ * @param sig Signal number (unused)
+ */
+static void mem_on_signal(int sig);
+
+/**
+ * @brief Initializes a buffer with a given capacity
+ *
+ * Allocates memory for the lines and line_len arrays and sets the initial
+ * state.
+ *
+ * @param buf Pointer to the buffer to initialize
+ * @param initial_capacity Initial number of lines the buffer can hold
+ */
+static void buffer_init(Buffer *buf, int initial_capacity);
+
+/**
+ * @brief Ensures the buffer has enough capacity for a required number of lines
+ *
+ * Dynamically expands the buffer capacity by doubling if necessary.
+ * Uses exponential growth to minimize reallocation overhead.
+ *
+ * @param buf Pointer to the buffer
+ * @param required Minimum number of lines needed
+ */
+static void buffer_ensure_capacity(Buffer *buf, int required);
+
+/**
+ * @brief Frees all memory associated with a buffer
+ *
+ * Deallocates each line string, then the lines and line_len arrays.
+ *
+ * @param buf Pointer to the buffer to free
+ */
+static void buffer_free(Buffer *buf);
+
+/**
+ * @brief Creates chunked storage holding a copy of some text
+ *
+ * @param text Text to copy (need not be NUL-terminated)
+ * @param len Number of bytes of text
+ * @return Newly allocated long line
+ */
+static LongLine *longline_new(const char *text, size_t len);
+
+/**
+ * @brief Frees a long line and all its chunks
+ *
+ * @param ll Long line to free, or NULL
+ */
+static void longline_free(LongLine *ll);
+
+/**
+ * @brief Rebuilds the Fenwick tree from the chunk lengths in linear time
+ *
+ * @param ll Pointer to the long line
+ */
+static void longline_rebuild(LongLine *ll);
+
+/**
+ * @brief Finds the chunk holding a byte position
+ *
+ * @param ll Pointer to the long line
+ * @param pos Byte position, at most the line length
+ * @param off Output: offset of pos within the returned chunk
+ * @return Index of the chunk
+ */
+static size_t longline_find(const LongLine *ll, size_t pos, size_t *off);
+
+/**
+ * @brief Inserts text into a long line
+ *
+ * Text that fits into the target chunk is inserted in place; otherwise the
+ * chunk is split and new chunks are spliced in.
+ *
+ * @param ll Pointer to the long line
+ * @param pos Byte position to insert at
+ * @param text Text to insert
+ * @param n Number of bytes to insert
+ */
+static void longline_insert(LongLine *ll, size_t pos, const char *text,
+                            size_t n);
+
+/**
+ * @brief Removes a range of bytes from a long line
+ *
+ * @param ll Pointer to the long line
+ * @param pos Byte position of the range
+ * @param n Number of bytes to remove
+ */
+static void longline_erase(LongLine *ll, size_t pos, size_t n);
+
+/**
+ * @brief Copies a range of bytes out of a long line
+ *
+ * @param ll Pointer to the long line
+ * @param pos Byte position of the range
+ * @param n Number of bytes to copy
+ * @param out Destination, at least n bytes
+ */
+static void longline_copy(const LongLine *ll, size_t pos, size_t n,
+                          char *out);
+
+/**
+ * @brief Merges underfull chunks and trims the chunk arrays of a long line
+ *
+ * @param ll Pointer to the long line
+ * @return Number of bytes released
+ */
+static size_t longline_compact(LongLine *ll);
+
+/**
+ * @brief Returns the contiguous text of a line
+ *
+ * A chunked or spilled line is copied into the buffer's scratch string,
+ * which costs time proportional to its length but leaves the line stored
+ * as it was.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @return The NUL-terminated line text, owned by the buffer; a scratch copy
+ * is only valid until the next call
+ */
+static const char *buffer_line(Buffer *buf, int at);
+
+/**
+ * @brief Inserts text into a line
+ *
+ * Converts the line to chunked storage when it reaches LONGLINE_MIN bytes.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position to insert at
+ * @param text Text to insert
+ * @param n Number of bytes to insert
+ */
+static void line_insert(Buffer *buf, int at, size_t pos, const char *text,
+                        size_t n);
+
+/**
+ * @brief Removes a range of bytes from a line
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position of the range
+ * @param n Number of bytes to remove
+ */
+static void line_erase(Buffer *buf, int at, size_t pos, size_t n);
+
+/**
+ * @brief Applies several edits to one line in a single pass
+ *
+ * Short lines are rebuilt once into an exactly sized allocation; chunked
+ * lines take the edits one at a time.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param sp Edits in increasing, non-overlapping position order
+ * @param k Number of edits
+ * @param text Text inserted at each edit position (may be NULL if n is 0)
+ * @param n Length of text
+ */
+static void line_splice(Buffer *buf, int at, const Splice *sp, int k,
+                        const char *text, size_t n);
+
+/**
+ * @brief Opens a gap of empty lines in the buffer
+ *
+ * The new lines have no text; the caller fills them in.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the first new line
+ * @param n Number of lines
+ */
+static void buffer_open_lines(Buffer *buf, int at, int n);
+
+/**
+ * @brief Inserts a new line into the buffer
+ *
+ * Shifts the following lines down. Long text is moved into chunked storage.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index the new line will have
+ * @param text Heap-allocated NUL-terminated text; ownership is taken
+ * @param len Length of text in bytes
+ */
+static void buffer_insert_line(Buffer *buf, int at, char *text, size_t len);
+
+/**
+ * @brief Moves a line's entries to another slot of the line arrays
+ *
+ * @param buf Pointer to the buffer
+ * @param dst Destination slot; its previous contents are overwritten
+ * @param src Source slot
+ */
+static void buffer_move_line(Buffer *buf, int dst, int src);
+
+/**
+ * @brief Moves a run of lines' entries within the line arrays
+ *
+ * @param buf Pointer to the buffer
+ * @param dst First destination slot
+ * @param src First source slot
+ * @param n Number of lines; the ranges may overlap
+ */
+static void buffer_shift_lines(Buffer *buf, int dst, int src, int n);
+
+/**
+ * @brief Fills a line slot with new text
+ *
+ * Long text is moved into chunked storage.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Slot to fill; its previous contents are overwritten
+ * @param text Heap-allocated NUL-terminated text; ownership is taken
+ * @param len Length of text in bytes
+ */
+static void line_set(Buffer *buf, int at, char *text, size_t len);
+
+/**
+ * @brief Saves the buffer contents to the file
+ *
+ * Writes all lines from the buffer to the associated filename,
+ * with each line followed by a newline character.
+ *
+ * If the file is as it was last loaded or saved, leading lines whose hash
+ * is unchanged are left on disk and only the rest is rewritten; when no
+ * line changed at all, nothing is written.
+ *
+ * @param ed Pointer to the editor state
+ * @return 1 on success, 0 on failure (file I/O error)
+ */
+static int save_buffer(Editor *ed);
+
+/**
+ * @brief Folds a 64-bit word into a running hash
+ *
+ * @param h Hash so far
+ * @param w Word to mix in
+ * @return The new hash
+ */
+static uint64_t hash_mix(uint64_t h, uint64_t w);
+
+/**
+ * @brief Hashes a piece of text
+ *
+ * Reads a 64-bit word at a time, so a line costs one multiply per eight
+ * bytes.
+ *
+ * @param s Text
+ * @param n Length in bytes
+ * @return 64-bit hash
+ */
+static uint64_t text_hash(const char *s, size_t n);
+
+/**
+ * @brief Reduces a product of two values below POLY_PRIME, plus a little
+ *
+ * @param x Value below 2^123
+ * @return x modulo POLY_PRIME
+ */
+static uint64_t poly_reduce(unsigned __int128 x);
+
+/**
+ * @brief Multiplies two values modulo POLY_PRIME
+ *
+ * @param a Value below POLY_PRIME
+ * @param b Value below POLY_PRIME
+ * @return a * b modulo POLY_PRIME
+ */
+static uint64_t poly_mul(uint64_t a, uint64_t b);
+
+/**
+ * @brief Combines the hashes of two pieces into the hash of both in order
+ *
+ * @param a Hash of the first piece
+ * @param b Hash of the piece after it
+ * @return Hash of a followed by b
+ */
+static PolyHash poly_join(PolyHash a, PolyHash b);
+
+/**
+ * @brief Raises POLY_BASE to a power modulo POLY_PRIME
+ *
+ * @param n Exponent
+ * @return POLY_BASE to the n
+ */
+static uint64_t poly_pow(size_t n);
+
+/**
+ * @brief Polynomial hash of some text, one element per byte
+ *
+ * Steps eight bytes at a time, so the chain of dependent multiplies is an
+ * eighth of the length.
+ *
+ * @param s Text
+ * @param n Length in bytes
+ * @return Hash of the text
+ */
+static PolyHash poly_bytes(const char *s, size_t n);
+
+/**
+ * @brief Polynomial hash of a long line from its chunk hashes
+ *
+ * Only chunks changed since their hash was cached are read.
+ *
+ * @param ll Pointer to the long line
+ * @return Hash of the whole line
+ */
+static PolyHash longline_hash(LongLine *ll);
+
+/**
+ * @brief Hashes the text of a line the way line_hash does
+ *
+ * @param s Text
+ * @param n Length in bytes
+ * @return text_hash for short text, a polynomial hash for LONGLINE_MIN
+ * bytes or more
+ */
+static uint64_t line_text_hash(const char *s, size_t n);
+
+/**
+ * @brief Returns the hash of a line's text, computing it if needed
+ *
+ * Lines shorter than LONGLINE_MIN use text_hash. Longer ones use the
+ * polynomial hash, which a chunked line combines from its chunk hashes, so
+ * an edit rehashes one chunk rather than the whole line.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ * @return Hash of the line
+ */
+static uint64_t line_hash(Buffer *buf, int at);
+
+/**
+ * @brief Widens the stale range of the digest tree by the edits since the
+ * last damage reset
+ *
+ * @param buf Pointer to the buffer
+ */
+static void digest_sync(Buffer *buf);
+
+/**
+ * @brief Recomputes the stale leaves of the digest tree and their ancestors
+ *
+ * @param buf Pointer to the buffer
+ * @param deadline Time (now_us) to stop by, or 0 to finish
+ * @return 1 if work remains, 0 when the tree is up to date
+ */
+static int digest_refresh(Buffer *buf, long long deadline);
+
+/**
+ * @brief Returns a digest of the whole buffer
+ *
+ * The root of the digest tree mixed with the line count. The result is
+ * cached until the next edit.
+ *
+ * @param buf Pointer to the buffer
+ * @return 64-bit digest
+ */
+static uint64_t buffer_digest(Buffer *buf);
+
+/**
+ * @brief Records the buffer as matching the file on disk
+ *
+ * @param buf Pointer to the buffer
+ * @param st Status of the file
+ */
+static void buffer_snapshot(Buffer *buf, const struct stat *st);
+
+/**
+ * @brief Checks whether the text differs from the file as loaded or saved
+ *
+ * Free when there were no edits since; otherwise costs a digest of the
+ * buffer unless one is cached.
+ *
+ * @param buf Pointer to the buffer
+ * @return Non-zero if the buffer was modified
+ */
+static int buffer_modified(Buffer *buf);
+
+/**
+ * @brief Cheap form of buffer_modified for the screen indicator
+ *
+ * Never computes the digest: while it is out of date the buffer is taken
+ * as modified, until the idle digest task catches up.
+ *
+ * @param buf Pointer to the buffer
+ * @return Non-zero if the buffer may be modified
+ */
+static int buffer_maybe_modified(const Buffer *buf);
+
+/**
+ * @brief Checks that the file is still as it was last loaded or saved
+ *
+ * Compares the device, inode, size and modification time.
+ *
+ * @param buf Pointer to the buffer
+ * @param filename Path to the file
+ * @return Non-zero if the file looks untouched
+ */
+static int buffer_disk_unchanged(const Buffer *buf, const char *filename);
+
+/**
+ * @brief Shrinks a line's storage to fit its text
+ *
+ * Short lines are reallocated to their exact size; long lines have adjacent
+ * underfull chunks merged and their chunk arrays trimmed.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @return Number of bytes released
+ */
+static size_t line_compact(Buffer *buf, int at);
+
+/**
+ * @brief Shrinks the per-line arrays after many lines were deleted
+ *
+ * @param buf Pointer to the buffer
+ * @return Number of bytes released
+ */
+static size_t buffer_shrink(Buffer *buf);
+
+/**
+ * @brief Creates the buffer's spill file in TMPDIR (or /tmp)
+ *
+ * @param buf Pointer to the buffer
+ * @return 1 on success, 0 if the file could not be created
+ */
+static int spill_open(Buffer *buf);
+
+/**
+ * @brief Appends bytes to the spill file
+ *
+ * @param buf Pointer to the buffer
+ * @param data Bytes to write
+ * @param n Number of bytes
+ * @return 1 on success, 0 on a write error
+ */
+static int spill_write(Buffer *buf, const char *data, size_t n);
+
+/**
+ * @brief Writes a batch of short lines and releases their memory
+ *
+ * Each pending line's spill offset is relative to the start of the block
+ * until the write succeeds. On failure the lines stay in memory.
+ *
+ * @param buf Pointer to the buffer
+ * @param block Concatenated text of the pending lines
+ * @param block_len Length of block
+ * @param pending Indices of the lines in block
+ * @param num_pending Number of pending lines
+ * @return 1 on success, 0 on a write error
+ */
+static int spill_flush(Buffer *buf, const char *block, size_t block_len,
+                       const int *pending, int num_pending);
+
+/**
+ * @brief Moves cold lines to the spill file while over the memory budget
+ *
+ * Sweeps the lines like a clock hand, skipping the hot window, until the
+ * heap is an eighth below the budget or SPILL_MAX_VISIT lines were looked
+ * at. Does nothing without a budget or while under it.
+ *
+ * @param buf Pointer to the buffer
+ * @param hot_lo First line of the window that must stay in memory
+ * @param hot_hi Line after the last one of that window
+ */
+static void buffer_spill(Buffer *buf, int hot_lo, int hot_hi);
+
+/**
+ * @brief Reads a spilled line back into memory
+ *
+ * Does nothing if the line is in memory already.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ */
+static void line_fault(Buffer *buf, int at);
+
+/**
+ * @brief Copies a spilled line's text from the spill file to a stream
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of a LINE_SPILLED line
+ * @param f Stream to write to
+ * @return 1 on success, 0 on an I/O error
+ */
+static int spill_copy(const Buffer *buf, int at, FILE *f);
+
+/**
+ * @brief Records that a line's text changed
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the changed line
+ */
+static void buffer_damage(Buffer *buf, int at);
+
+/**
+ * @brief Records that lines were inserted or deleted
+ *
+ * @param buf Pointer to the buffer
+ * @param at First line whose index changed
+ */
+static void buffer_reshape(Buffer *buf, int at);
+
+/**
+ * @brief Clears the damage range and the reshaped flag
+ *
+ * Called once all layout caches have caught up with the edits.
+ *
+ * @param buf Pointer to the buffer
+ */
+static void buffer_damage_reset(Buffer *buf);
+
+/**
+ * @brief Deletes a line from the buffer
+ *
+ * Removes the line at the specified index, shifting all subsequent lines up.
+ * Frees the memory of the deleted line.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line to delete
+ */
+static void delete_line(Buffer *buf, int at);
+
+/**
+ * @brief Deletes a run of lines with a single move of the line arrays
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the first line to delete
+ * @param n Number of lines
+ */
+static void buffer_remove_lines(Buffer *buf, int at, int n);
+
+/**
+ * @brief Frees a line's text and caches, or drops its clip reference
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ */
+static void line_release(Buffer *buf, int at);
+
+/**
+ * @brief Gives a line sharing clip text its own copy before an edit
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ */
+static void line_own(Buffer *buf, int at);
+
+/**
+ * @brief Copies a range of bytes out of any line
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position of the range
+ * @param n Number of bytes to copy
+ * @param out Destination, at least n bytes
+ */
+static void line_copy(Buffer *buf, int at, size_t pos, size_t n, char *out);
+
+/**
+ * @brief Copies a range of bytes out of any line without changing it
+ *
+ * Unlike line_copy, a spilled line is read from the spill file and stays
+ * there.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position of the range
+ * @param n Number of bytes to copy
+ * @param out Destination, at least n bytes
+ */
+static void line_read(Buffer *buf, int at, size_t pos, size_t n, char *out);
+
+/**
+ * @brief Compares a line with a string, reading it a block at a time
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param text Text to compare with
+ * @param len Length of text
+ * @return 1 if the line holds exactly text, 0 otherwise
+ */
+static int line_equal(Buffer *buf, int at, const char *text, size_t len);
+
+/**
+ * @brief Allocates a clip with room for the given number of lines
+ *
+ * @param num_lines Number of lines
+ * @return The clip, holding one reference
+ */
+static Clip *clip_new(int num_lines);
+
+/**
+ * @brief Drops a reference to a clip, freeing it with the last one
+ *
+ * @param clip The clip, or NULL
+ */
+static void clip_unref(Clip *clip);
+
+/**
+ * @brief Captures a range of the buffer as a clip
+ *
+ * Only the partial first and last lines (and long lines) are copied. Whole
+ * lines in between are handed to the clip; on a copy the buffer shares
+ * them, on a cut the caller is expected to delete them.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line of the range
+ * @param x0 Byte offset where the range starts
+ * @param y1 Last line of the range
+ * @param x1 Byte offset where the range ends
+ * @param cut Non-zero if the range is about to be deleted
+ * @return The new clip
+ */
+static Clip *clip_from_range(Buffer *buf, int y0, int x0, int y1, int x1,
+                             int cut);
+
+/**
+ * @brief Deletes a range that may span lines
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line of the range
+ * @param x0 Byte offset where the range starts
+ * @param y1 Last line of the range
+ * @param x1 Byte offset where the range ends
+ */
+static void buffer_delete_range(Buffer *buf, int y0, int x0, int y1, int x1);
+
+/**
+ * @brief Applies a batch of replacements in one pass over the buffer
+ *
+ * Edits must be sorted and must not overlap. Edits that share a line are
+ * merged into one block whose new lines are built with exactly sized
+ * allocations; the untouched lines between blocks are then moved to their
+ * final slots with one move each. The cost is linear in the lines and text
+ * touched, whatever the number of edits.
+ *
+ * @param buf Pointer to the buffer
+ * @param edits Edits in document order
+ * @param k Number of edits
+ */
+static void buffer_apply(Buffer *buf, const Edit *edits, int k);
+
+/**
+ * @brief Builds the new lines of one block of a batch
+ *
+ * @param buf Pointer to the buffer
+ * @param e The block's edits
+ * @param n Number of edits
+ * @param out Receives the new lines, heap-allocated and NUL-terminated
+ * @param out_len Receives their lengths
+ */
+static void edit_block_build(Buffer *buf, const Edit *e, int n,
+                             char **out, size_t *out_len);
+
+/**
+ * @brief Applies a lazy tag to a mark subtree
+ *
+ * @param m Root of the subtree, or NULL
+ * @param set Non-zero to collapse every mark onto line to
+ * @param to Line to collapse onto
+ * @param add Lines to shift by, after any collapse
+ */
+static void mark_tag(Mark *m, int set, int to, int add);
+
+/**
+ * @brief Hands a mark's pending tag down to its children
+ *
+ * @param m Mark to push
+ */
+static void mark_push(Mark *m);
+
+/**
+ * @brief Splits a mark tree by line
+ *
+ * @param t Root of the tree, or NULL
+ * @param line Split point
+ * @param l Receives the marks before line
+ * @param r Receives the marks at or after line
+ */
+static void mark_split(Mark *t, int line, Mark **l, Mark **r);
+
+/**
+ * @brief Joins two mark trees whose lines are in order
+ *
+ * @param a Tree of the earlier marks, or NULL
+ * @param b Tree of the later marks, or NULL
+ * @return Root of the joined tree
+ */
+static Mark *mark_merge(Mark *a, Mark *b);
+
+/**
+ * @brief Makes a tree the buffer's mark tree
+ *
+ * @param buf Pointer to the buffer
+ * @param root New root, or NULL
+ */
+static void marks_root(Buffer *buf, Mark *root);
+
+/**
+ * @brief Adds a mark
+ *
+ * @param buf Pointer to the buffer
+ * @param line Line to anchor to
+ * @param x Byte offset in the line
+ * @param name Letter of a named mark, or 0 for a bookmark
+ * @return The new mark
+ */
+static Mark *mark_add(Buffer *buf, int line, size_t x, int name);
+
+/**
+ * @brief Removes and frees a mark
+ *
+ * @param buf Pointer to the buffer
+ * @param m Mark to remove
+ */
+static void mark_remove(Buffer *buf, Mark *m);
+
+/**
+ * @brief Returns a mark's current line
+ *
+ * @param m The mark
+ * @return Its line, pushing down the pending tags above it first
+ */
+static int mark_line(Mark *m);
+
+/**
+ * @brief Finds a mark on a line by name
+ *
+ * @param m Root of the mark tree to search, or NULL
+ * @param line Line to look on
+ * @param name Letter of a named mark, or 0 for a bookmark
+ * @return The mark, or NULL
+ */
+static Mark *mark_find(Mark *m, int line, int name);
+
+/**
+ * @brief Returns the first mark after a line
+ *
+ * @param buf Pointer to the buffer
+ * @param line Line to look after
+ * @return The mark, or NULL if none is later
+ */
+static Mark *mark_next(Buffer *buf, int line);
+
+/**
+ * @brief Shifts marks for lines opened in the buffer
+ *
+ * Folds are shifted too (see folds_insert_lines).
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the first new line
+ * @param n Number of lines
+ */
+static void marks_insert_lines(Buffer *buf, int at, int n);
+
+/**
+ * @brief Shifts marks for lines removed from the buffer
+ *
+ * Folds are shifted too (see folds_remove_lines).
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the first removed line
+ * @param n Number of lines
+ * @param to Line that the marks on removed lines move to
+ */
+static void marks_remove_lines(Buffer *buf, int at, int n, int to);
+
+/**
+ * @brief Frees a mark tree
+ *
+ * @param m Root of the tree, or NULL
+ */
+static void marks_free(Mark *m);
+
+/**
+ * @brief Makes the text of a range of lines resident and contiguous
+ *
+ * Spilled lines are read back and long lines flattened, so their text can
+ * be read through buf->lines without further calls.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ */
+static void buffer_flatten(Buffer *buf, int y0, int y1);
+
+/**
+ * @brief Moves lines of LONGLINE_MIN bytes or more back into chunks
+ *
+ * Undoes buffer_flatten once the lines no longer need to be contiguous.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ */
+static void buffer_rechunk(Buffer *buf, int y0, int y1);
+
+/**
+ * @brief Rearranges a range of lines by moving their handles
+ *
+ * No text is copied: the per-line entries are permuted, and lines that
+ * are not kept are freed and the lines below moved up.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line of the range
+ * @param n Number of lines in the range
+ * @param order Range-relative line that goes in each slot, or NULL to keep
+ * the order
+ * @param keep Per slot, non-zero to keep the line put there; NULL keeps all
+ * @return Number of lines left in the range
+ */
+static int buffer_reorder(Buffer *buf, int y0, int n, const int *order,
+                          const char *keep);
+
+/**
+ * @brief Fills in the sort handle of a line
+ *
+ * @param buf Pointer to the buffer, with the line flattened
+ * @param at Line index
+ * @param spec Sort options
+ * @param out Receives the key
+ */
+static void sort_key(const Buffer *buf, int at, const SortSpec *spec,
+                     SortLine *out);
+
+/**
+ * @brief Compares two sort handles
+ *
+ * @param a First handle
+ * @param b Second handle
+ * @param spec Sort options
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int sort_cmp(const SortLine *a, const SortLine *b,
+                    const SortSpec *spec);
+
+/**
+ * @brief Merges two sorted runs, taking from the first on ties
+ *
+ * @param a First run
+ * @param na Length of the first run
+ * @param b Second run
+ * @param nb Length of the second run
+ * @param out Receives na + nb handles
+ * @param spec Sort options
+ */
+static void sort_merge(const SortLine *a, size_t na, const SortLine *b,
+                       size_t nb, SortLine *out, const SortSpec *spec);
+
+/**
+ * @brief Stable merge sort of handles
+ *
+ * @param a Handles to sort
+ * @param tmp Scratch of the same length
+ * @param n Number of handles
+ * @param spec Sort options
+ */
+static void sort_run(SortLine *a, SortLine *tmp, size_t n,
+                     const SortSpec *spec);
+
+/**
+ * @brief Thread body of a parallel sort: sorts or merges one slice
+ *
+ * @param arg The SortJob
+ * @return NULL
+ */
+static void *sort_thread(void *arg);
+
+/**
+ * @brief Runs sort jobs in parallel and waits for them
+ *
+ * A job whose thread cannot be started runs on the calling thread.
+ *
+ * @param jobs Jobs to run
+ * @param n Number of jobs
+ */
+static void sort_jobs(SortJob *jobs, int n);
+
+/**
+ * @brief Sorts a range of lines
+ *
+ * Slices of the range are keyed and sorted on separate threads, then
+ * merged pairwise; only the line handles move.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ * @param spec Sort options
+ * @return Number of lines left in the range
+ */
+static int buffer_sort(Buffer *buf, int y0, int y1, const SortSpec *spec);
+
+/**
+ * @brief Removes lines equal to the line before them
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ * @return Number of lines left in the range
+ */
+static int buffer_uniq(Buffer *buf, int y0, int y1);
+
+/**
+ * @brief Reverses the order of a range of lines
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ */
+static void buffer_reverse(Buffer *buf, int y0, int y1);
+
+/**
+ * @brief Replaces a range of lines with new ones in one step
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line of the range
+ * @param old Number of lines replaced
+ * @param text New lines, heap-allocated; ownership is taken
+ * @param len Lengths of the new lines
+ * @param n Number of new lines
+ */
+static void buffer_replace_lines(Buffer *buf, int y0, int old, char **text,
+                                 const size_t *len, int n);
+
+/**
+ * @brief Starts a shell command with pipes to its stdin and stdout
+ *
+ * Its stderr goes to /dev/null so the screen is left alone.
+ *
+ * @param cmd Command for /bin/sh -c
+ * @param to_child Receives the write end of the child's stdin
+ * @param from_child Receives the read end of the child's stdout
+ * @return Child process id, or -1 on error
+ */
+static pid_t filter_spawn(const char *cmd, int *to_child, int *from_child);
+
+/**
+ * @brief Writes the next part of the range to a filter with one writev
+ *
+ * Resident lines are handed over in place; spilled and long lines go
+ * through the staging area.
+ *
+ * @param buf Pointer to the buffer
+ * @param in Feed state
+ * @param fd Non-blocking pipe to the child
+ * @return 1 while there is more to write, 0 when done, -1 on error
+ */
+static int filter_write(Buffer *buf, FilterIn *in, int fd);
+
+/**
+ * @brief Finishes a line that has been written to a filter
+ *
+ * @param buf Pointer to the buffer
+ * @param in Feed state
+ * @param at The line
+ */
+static void filter_done(Buffer *buf, FilterIn *in, int at);
+
+/**
+ * @brief Splits filter output into lines
+ *
+ * @param out Read state
+ * @param data Bytes read
+ * @param n Number of bytes
+ */
+static void filter_read(FilterOut *out, const char *data, size_t n);
+
+/**
+ * @brief Adds a completed line to the filter output
+ *
+ * @param out Read state
+ * @param text Heap-allocated NUL-terminated line; ownership is taken
+ * @param len Length of the line
+ */
+static void filter_push(FilterOut *out, char *text, size_t len);
+
+/**
+ * @brief Replaces a range of lines with the output of a shell command
+ *
+ * The range is written to the command's stdin while its stdout is read,
+ * both through non-blocking pipes, so neither side is held in full. The
+ * range is only replaced if the command exits with status 0.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ * @param cmd Command for /bin/sh -c
+ * @param status Receives the exit status, or -1 if it could not be run
+ * @return Number of lines the range became, or -1 if it was left alone
+ */
+static int buffer_filter(Buffer *buf, int y0, int y1, const char *cmd,
+                         int *status);
+
+/**
+ * @brief Replaces regex matches in a range of lines in one pass
+ *
+ * All matches are collected first and applied with a single buffer_apply.
+ * In the replacement, & stands for the match, \1 to \9 for groups, \n
+ * for a line break and \& or \\ for a literal character.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ * @param re Compiled pattern
+ * @param repl Replacement template
+ * @param global Non-zero to replace every match on a line, not the first
+ * @param only Per line of the range, non-zero to search it; NULL for all
+ * @return Number of replacements made
+ */
+static int buffer_substitute(Buffer *buf, int y0, int y1, const regex_t *re,
+                             const char *repl, int global, const char *only);
+
+/**
+ * @brief Cuts one delimited part off a pattern in place
+ *
+ * An escaped delimiter stands for itself; other escapes are kept as they
+ * are for the regex or the replacement to interpret.
+ *
+ * @param s Start of the part; advanced past its closing delimiter
+ * @param d Delimiter
+ * @return The NUL-terminated part, or NULL if no delimiter closes it
+ */
+static char *pattern_split(char **s, char d);
+
+/**
+ * @brief Parses and compiles the /RE/REPL/FLAGS of a substitution
+ *
+ * Patterns are POSIX extended regexes. Flags are g (every match on a line)
+ * and i (ignore case).
+ *
+ * @param text Text starting at the delimiter, modified in place
+ * @param re Receives the compiled pattern; the caller frees it with regfree
+ * @param repl Receives the replacement template, pointing into text
+ * @param global Receives the g flag
+ * @param err Receives a message on failure
+ * @param err_len Size of err
+ * @return 1 on success, 0 on a syntax error
+ */
+static int subst_parse(char *text, regex_t *re, char **repl, int *global,
+                       char *err, size_t err_len);
+
+/**
+ * @brief Moves a range of lines to below another line
+ *
+ * The span between the range and the target is rotated in one pass over
+ * the line handles; no text is copied.
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line of the range
+ * @param y1 Last line of the range
+ * @param after Line to move below, outside the range; -1 for the top
+ */
+static void buffer_move_range(Buffer *buf, int y0, int y1, int after);
+
+/**
+ * @brief Adds an empty line if the buffer has none left
+ *
+ * @param buf Pointer to the buffer
+ */
+static void buffer_ensure_line(Buffer *buf);
+
+/**
+ * @brief Inserts a clip at a position
+ *
+ * Whole middle lines of the clip are shared, not copied.
+ *
+ * @param buf Pointer to the buffer
+ * @param y Line to paste into; updated to the line after the paste
+ * @param x Byte offset to paste at; updated to the end of the paste
+ * @param clip The clip to paste
+ */
+static void buffer_paste(Buffer *buf, int *y, int *x, Clip *clip);
+
+/**
+ * @brief Checks whether text is pure ASCII
+ *
+ * Uses SSE2 to test 64 bytes per iteration where available, and 8-byte words
+ * otherwise.
+ *
+ * @param s Text to check
+ * @param n Number of bytes
+ * @return 1 if no byte has the high bit set, 0 otherwise
+ */
+static int text_is_ascii(const char *s, size_t n);
+
+/**
+ * @brief Checks whether text is printable ASCII only
+ *
+ * Uses SSE2 to test 16 bytes per iteration where available.
+ *
+ * @param s Text to check
+ * @param n Number of bytes
+ * @return 1 if every byte is in 0x20..0x7E, 0 otherwise
+ */
+static int text_is_plain(const char *s, size_t n);
+
+/**
+ * @brief Computes the LINE_ASCII and LINE_PLAIN flags for some text
+ *
+ * @param text Text to classify
+ * @param n Number of bytes
+ * @return The flags that hold for every byte of text
+ */
+static unsigned line_flags(const char *text, size_t n);
+
+/**
+ * @brief Returns the contiguous run of bytes starting at a position
+ *
+ * For plain lines this is the rest of the line; for long lines it is the
+ * rest of the chunk holding pos.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position, less than the line length
+ * @param avail Output: number of contiguous bytes available
+ * @return Pointer to the byte at pos
+ */
+static const char *line_span(Buffer *buf, int at, size_t pos, size_t *avail);
+
+/**
+ * @brief Reads one byte of a line
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position, less than the line length
+ * @return The byte value
+ */
+static int line_byte(Buffer *buf, int at, size_t pos);
+
+/**
+ * @brief Decodes one UTF-8 character
+ *
+ * @param s Bytes to decode
+ * @param n Number of bytes available (at least 1)
+ * @param wc Output: the code point, or U+FFFD for an invalid sequence
+ * @return Number of bytes consumed (1 for an invalid sequence)
+ */
+static size_t utf8_decode(const unsigned char *s, size_t n, wchar_t *wc);
+
+/**
+ * @brief Decodes the UTF-8 character at a position in a line
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte position, less than the line length
+ * @param wc Output: the code point
+ * @return Number of bytes consumed
+ */
+static size_t line_decode(Buffer *buf, int at, size_t pos, wchar_t *wc);
+
+/**
+ * @brief Screen columns taken by a character at a given column
+ *
+ * Tabs run to the next multiple of TAB_STOP and control characters take two
+ * columns (caret notation). Other characters use wcwidth(), or 1 if they
+ * have none.
+ *
+ * @param wc The code point
+ * @param col Screen column the character starts at
+ * @return Number of screen columns
+ */
+static int cell_width(wchar_t wc, size_t col);
+
+/**
+ * @brief Frees a line's cached render row
+ *
+ * @param info Metadata of the line
+ */
+static void line_render_drop(LineInfo *info);
+
+/**
+ * @brief Returns the render row of a short ASCII line, building it if needed
+ *
+ * @param buf Pointer to the buffer (only the line's cache is modified)
+ * @param at Index of a plain-storage line with LINE_ASCII set
+ * @return The render row; its length is in info[at].render_len
+ */
+static const char *line_render(Buffer *buf, int at);
+
+/**
+ * @brief Frees a column map
+ *
+ * @param m Column map to free, or NULL
+ */
+static void colmap_free(ColMap *m);
+
+/**
+ * @brief Drops the checkpoints after an edited byte position
+ *
+ * @param m Pointer to the column map
+ * @param pos Byte position of the edit
+ */
+static void colmap_truncate(ColMap *m, size_t pos);
+
+/**
+ * @brief Builds a line's column map at least as far as a target
+ *
+ * Creates the map if needed and decodes until byte_target is reached or the
+ * column passes col_target, whichever comes first.
+ *
+ * @param buf Pointer to the buffer (only the line's cache is modified)
+ * @param at Index of the line
+ * @param byte_target Byte offset that must be covered
+ * @param col_target Screen column that must be covered
+ * @return The line's column map
+ */
+static ColMap *colmap_extend(Buffer *buf, int at, size_t byte_target,
+                             size_t col_target);
+
+/**
+ * @brief Converts a byte offset to a screen column
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte offset, at most the line length
+ * @return Screen column of pos
+ */
+static size_t line_col(Buffer *buf, int at, size_t pos);
+
+/**
+ * @brief Converts a screen column to a byte offset
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param col Screen column
+ * @return Byte offset of the character covering col, or the line length
+ */
+static size_t line_pos(Buffer *buf, int at, size_t col);
+
+/**
+ * @brief Width of a whole line in screen columns
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @return Number of screen columns
+ */
+static size_t line_width(Buffer *buf, int at);
+
+/**
+ * @brief Steps one character forward or backward
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param pos Byte offset of a character boundary
+ * @param dir 1 to step forward, -1 to step backward
+ * @return Byte offset of the neighbouring boundary (pos at either end)
+ */
+static size_t utf8_step(Buffer *buf, int at, size_t pos, int dir);
+
+/**
+ * @brief Displays a message on the bottom status line
+ *
+ * Shows a message in reverse video on the last line of the terminal.
+ * Useful for displaying status updates like "File saved successfully".
+ *
+ * @param msg The message string to display
+ */
+static void show_message(const char *msg);
+
+/**
+ * @brief Shows a message on the bottom line without moving the cursor
+ *
+ * @param msg The message string to display
+ */
+static void show_status(const char *msg);
+
+/**
+ * @brief Prints a range of screen columns of a line on a screen row
+ *
+ * Printable ASCII lines are printed byte for byte and other short ASCII
+ * lines are sliced from their render row. Remaining lines are decoded and
+ * drawn through the wide-character API, with tabs expanded, control
+ * characters in caret notation and invalid bytes shown as U+FFFD. Only the
+ * visible part of the line is examined.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the line
+ * @param col First screen column to print
+ * @param ncols Number of screen columns available
+ * @param row Screen row to print on
+ */
+static void draw_cols(Buffer *buf, int at, size_t col, int ncols, int row);
+
+/**
+ * @brief Prints a range of screen columns of raw text on a screen row
+ *
+ * Text outside the buffer, such as a pager line, is drawn with the same
+ * rules as draw_cols: tabs expanded, control characters in caret notation,
+ * invalid bytes as U+FFFD and clipping by display width.
+ *
+ * @param text The text, not NUL-terminated
+ * @param len Length of text in bytes
+ * @param col First screen column to print
+ * @param ncols Number of screen columns available
+ * @param row Screen row to print on
+ */
+static void draw_bytes(const char *text, size_t len, size_t col, int ncols,
+                       int row);
+
+/**
+ * @brief Redraws the editor viewport
+ *
+ * Renders visible lines based on the current viewport offset. Handles both
+ * horizontal and vertical scrolling, positioning the cursor correctly. If
+ * the viewport and line layout are unchanged since the last call, only the
+ * rows of damaged lines are redrawn.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void redraw(Editor *ed);
+
+/**
+ * @brief Draws the modified indicator in the top right corner
+ *
+ * @param ed Pointer to the editor state
+ * @return Non-zero if the indicator was drawn
+ */
+static int draw_modified(const Editor *ed);
+
+/**
+ * @brief Constrains cursor position within valid bounds and adjusts viewport
+ *
+ * Ensures the cursor position is within the buffer and viewport limits.
+ * Adjusts the viewport offset (rowoff, coloff) to keep the cursor visible
+ * on screen by automatically scrolling when necessary. A cursor that lands
+ * on a hidden line, after a jump or an edit, opens the fold.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void clamp_cursor(Editor *ed);
+
+/**
+ * @brief Number of visual rows a line takes when wrapped
+ *
+ * @param cols Width of the line in screen columns
+ * @param width Screen width
+ * @return Number of rows, at least 1
+ */
+static int wrap_line_rows(size_t cols, int width);
+
+/**
+ * @brief Rebuilds the wrap index for every line
+ *
+ * @param w Pointer to the wrap index
+ * @param buf Pointer to the buffer
+ * @param width Screen width to wrap at
+ */
+static void wrap_rebuild(WrapIndex *w, Buffer *buf, int width);
+
+/**
+ * @brief Brings the wrap index up to date after edits or a resize
+ *
+ * @param ed Pointer to the editor state
+ */
+static void wrap_sync(Editor *ed);
+
+/**
+ * @brief Counts the visual rows before a line
+ *
+ * @param w Pointer to the wrap index
+ * @param line Index of the line
+ * @return Visual row at which the line starts
+ */
+static long wrap_prefix(const WrapIndex *w, int line);
+
+/**
+ * @brief Finds the line shown on a visual row
+ *
+ * @param w Pointer to the wrap index
+ * @param vrow Visual row
+ * @param sub Output: row within the line
+ * @return Index of the line (the last line if vrow is past the end)
+ */
+static int wrap_find(const WrapIndex *w, long vrow, int *sub);
+
+/**
+ * @brief Finds the visual row and column of a position
+ *
+ * The cursor after the last character of a line that exactly fills its
+ * last row stays on that row, on its last column.
+ *
+ * @param w Pointer to the wrap index
+ * @param line Index of the line
+ * @param col Screen column of the position within the line
+ * @param x Output: column on the visual row
+ * @return Visual row of the position
+ */
+static long wrap_cursor(const WrapIndex *w, int line, size_t col, int *x);
+
+/**
+ * @brief Turns soft wrap on or off, keeping the top line in view
+ *
+ * @param ed Pointer to the editor state
+ */
+static void wrap_toggle(Editor *ed);
+
+/**
+ * @brief Moves the cursor up or down one visual row in soft wrap
+ *
+ * @param ed Pointer to the editor state
+ * @param dir -1 to move up, 1 to move down
+ */
+static void wrap_move(Editor *ed, int dir);
+
+/**
+ * @brief Redraws the viewport with soft wrap
+ *
+ * @param ed Pointer to the editor state
+ */
+static void wrap_redraw(Editor *ed);
+
+/**
+ * @brief Builds the Fenwick tree of the wrap index from its row counts
+ *
+ * Folded lines contribute no rows. Linear in the number of lines, without
+ * measuring any of them again.
+ *
+ * @param w Pointer to the wrap index
+ * @param buf Pointer to the buffer
+ */
+static void wrap_refen(WrapIndex *w, const Buffer *buf);
+
+/**
+ * @brief Returns the width of a line's leading white space
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ * @return Indentation in screen columns, or -1 for a blank line
+ */
+static int line_indent(Buffer *buf, int at);
+
+/**
+ * @brief Finds the line closing the bracket that ends a header line
+ *
+ * Uses the bracket index. When more text follows
+ * the closing bracket on its line, as in "} else {", the region stops at the
+ * line before.
+ *
+ * @param buf Pointer to the buffer
+ * @param y Header line, whose last non-blank byte is an opening bracket
+ * @return Last line of the region, or -1 if the bracket is never closed
+ */
+static int fold_bracket_end(Buffer *buf, int y);
+
+/**
+ * @brief Returns the opening bracket that ends a line, if any
+ *
+ * @param buf Pointer to the buffer
+ * @param y Line number
+ * @return '(', '[' or '{', or 0 for an indentation header
+ */
+static int fold_kind(Buffer *buf, int y);
+
+/**
+ * @brief Finds the foldable region starting at a line
+ *
+ * A line ending in an opening bracket folds down to the matching bracket;
+ * any other line folds the lines below it that are indented deeper (blank
+ * lines in between included).
+ *
+ * @param buf Pointer to the buffer
+ * @param y Header line
+ * @param kind Receives fold_kind of the header
+ * @return Last line of the region, or y if there is nothing to fold
+ */
+static int fold_region(Buffer *buf, int y, int *kind);
+
+/**
+ * @brief Finds the nearest header above a line whose region covers it
+ *
+ * @param buf Pointer to the buffer
+ * @param y Line number
+ * @return Header line, or -1 if there is none
+ */
+static int fold_enclosing(Buffer *buf, int y);
+
+/**
+ * @brief Finds the last fold starting at or before a line
+ *
+ * @param fs Pointer to the fold set
+ * @param line Line number
+ * @return Index of the fold, or -1 if there is none
+ */
+static int fold_find(const FoldSet *fs, int line);
+
+/**
+ * @brief Maps a line to the header of the fold hiding it
+ *
+ * @param buf Pointer to the buffer
+ * @param line Line number
+ * @return The header if the line is hidden, otherwise the line itself
+ */
+static int fold_header(const Buffer *buf, int line);
+
+/**
+ * @brief Maps a line to the first visible line at or after it
+ *
+ * @param buf Pointer to the buffer
+ * @param line Line number
+ * @return The line after the fold if the line is hidden, otherwise the
+ * line itself
+ */
+static int fold_visible(const Buffer *buf, int line);
+
+/**
+ * @brief Returns the screen row of a visible line, counting from line 0
+ *
+ * @param buf Pointer to the buffer
+ * @param line A visible line
+ * @return The line number less the lines hidden above it
+ */
+static int fold_row(const Buffer *buf, int line);
+
+/**
+ * @brief Returns the visible line shown on a row, counting from line 0
+ *
+ * The inverse of fold_row. Rows past the end give lines past the end.
+ *
+ * @param buf Pointer to the buffer
+ * @param row Screen row
+ * @return Line number
+ */
+static int fold_line_at(const Buffer *buf, int row);
+
+/**
+ * @brief Recomputes the hidden line counts after folds change
+ *
+ * @param fs Pointer to the fold set
+ */
+static void fold_reindex(FoldSet *fs);
+
+/**
+ * @brief Collapses a region, absorbing any folds inside it
+ *
+ * A fold that already hides the header is extended instead.
+ *
+ * @param buf Pointer to the buffer
+ * @param start Header line
+ * @param end Last line to hide
+ * @param kind fold_kind of the header
+ */
+static void fold_add(Buffer *buf, int start, int end, int kind);
+
+/**
+ * @brief Opens one fold
+ *
+ * @param fs Pointer to the fold set
+ * @param i Index of the fold
+ */
+static void fold_remove(FoldSet *fs, int i);
+
+/**
+ * @brief Shifts folds for lines opened in the buffer
+ *
+ * Lines opened inside a fold are hidden with it.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the first new line
+ * @param n Number of lines
+ */
+static void folds_insert_lines(Buffer *buf, int at, int n);
+
+/**
+ * @brief Shifts folds for lines removed from the buffer
+ *
+ * A fold loses its hidden lines that were removed, and is dropped with its
+ * header line or once nothing is left to hide.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Index of the first removed line
+ * @param n Number of lines
+ */
+static void folds_remove_lines(Buffer *buf, int at, int n);
+
+/**
+ * @brief Opens every fold that overlaps a range of lines
+ *
+ * @param buf Pointer to the buffer
+ * @param y0 First line
+ * @param y1 Last line
+ */
+static void folds_drop(Buffer *buf, int y0, int y1);
+
+/**
+ * @brief Re-derives the folds touched by the last edits
+ *
+ * Only folds overlapping the buffer's damage range are looked at. One whose
+ * header alone was edited and still ends in the same bracket is kept as it
+ * is; any other is recomputed from its header, or opened if the header no
+ * longer starts a region.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void fold_sync(Editor *ed);
+
+/**
+ * @brief Folds or unfolds at the cursor
+ *
+ * On a fold header the fold is opened. Otherwise the region starting at the
+ * cursor line is collapsed, or failing that the indentation block around
+ * it, and the cursor moves to its header.
+ *
+ * @param ed Pointer to the editor state
+ * @param status Buffer for a status message
+ * @param status_len Size of status
+ */
+static void fold_toggle(Editor *ed, char *status, size_t status_len);
+
+/**
+ * @brief Draws the hidden line count after a fold header
+ *
+ * Does nothing unless the line is the header of a fold.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line drawn on the row
+ * @param col First column of the line shown on the row
+ * @param ncols Number of columns on the row
+ * @param row Screen row
+ */
+static void fold_draw(Buffer *buf, int at, size_t col, int ncols, int row);
+
+/**
+ * @brief Scans a line for brackets outside strings and character literals
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ * @param sum Receives the line's summary
+ * @param events If not NULL, receives a MEM_OTHER array with pos * 2 + 1 for
+ * each opening bracket and pos * 2 for each closing one, in line order
+ * @return Number of brackets
+ */
+static size_t bracket_scan(Buffer *buf, int at, BracketSum *sum,
+                           size_t **events);
+
+/**
+ * @brief Scans part of a line for brackets, carrying the scanner state
+ *
+ * Scanning a line in consecutive runs, each starting from the state the
+ * previous one ended in, finds the same brackets as one scan. A character
+ * literal near the end of a run may look at up to three bytes after it.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ * @param from Byte offset to start at
+ * @param to Byte offset to stop at
+ * @param state Scanner state, 0 at the start of a line; updated to the
+ * state at to
+ * @param sum Receives the summary of the run
+ * @param events As for bracket_scan, with offsets from the line start
+ * @return Number of brackets in the run
+ */
+static size_t bracket_run(Buffer *buf, int at, size_t from, size_t to,
+                          int *state, BracketSum *sum, size_t **events);
+
+/**
+ * @brief Summarizes a chunked line from its per-chunk bracket summaries
+ *
+ * Only chunks that were edited, or whose start state or following bytes
+ * changed, are scanned again, so an edit costs one chunk and a pass over
+ * the cached summaries.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number of a line in long_lines
+ * @param deadline Time (now_us) by which to stop, or 0 to finish
+ * @param sum Receives the line's summary
+ * @return 1 when done, 0 if the deadline passed first
+ */
+static int longline_brackets(Buffer *buf, int at, long long deadline,
+                             BracketSum *sum);
+
+/**
+ * @brief Returns the bracket summary of a line, scanning it if needed
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ * @return The summary
+ */
+static BracketSum line_brackets(Buffer *buf, int at);
+
+/**
+ * @brief Summarizes a run of text from the summaries of its two halves
+ *
+ * @param a Summary of the first half
+ * @param b Summary of the second half
+ * @return Summary of both
+ */
+static BracketSum bracket_join(BracketSum a, BracketSum b);
+
+/**
+ * @brief Marks the lines changed by the last edits as dirty in the index
+ *
+ * Inserted or deleted lines move every block boundary after them, so they
+ * dirty the whole index; its leaves are then rebuilt from the cached line
+ * summaries without rescanning unchanged text.
+ *
+ * @param buf Pointer to the buffer
+ */
+static void bracket_sync(Buffer *buf);
+
+/**
+ * @brief Brings the bracket index up to date
+ *
+ * @param buf Pointer to the buffer
+ * @param deadline Time (now_us) by which to stop, or 0 to finish
+ * @return 1 if work remains, 0 when the index is current
+ */
+static int bracket_refresh(Buffer *buf, long long deadline);
+
+/**
+ * @brief Finds the first leaf at or after b where the depth drops to zero
+ *
+ * @param ix Pointer to the bracket index
+ * @param b First leaf to look at
+ * @param need Unmatched opening brackets; reduced by the leaves skipped
+ * @return The leaf, or -1 if the depth never drops that far
+ */
+static int bracket_tree_forward(const BracketIndex *ix, int b, int *need);
+
+/**
+ * @brief Finds the last leaf at or before b where the depth rises to zero
+ *
+ * @param ix Pointer to the bracket index
+ * @param b Last leaf to look at
+ * @param need Unmatched closing brackets; reduced by the leaves skipped
+ * @return The leaf, or -1 if there are not enough opening brackets
+ */
+static int bracket_tree_backward(const BracketIndex *ix, int b, int *need);
+
+/**
+ * @brief Finds where a count of unmatched brackets drops to zero in a line
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ * @param x Forward: first byte to look at; backward: byte to stop before
+ * @param dir 1 to scan forward over closing brackets, -1 to scan backward
+ * over opening ones
+ * @param need Unmatched brackets; updated by the brackets passed
+ * @return Byte offset of the bracket that matched, or SIZE_MAX
+ */
+static size_t bracket_in_line(Buffer *buf, int at, size_t x, int dir,
+                              int *need);
+
+/**
+ * @brief Finds the closing bracket for unmatched openers before a position
+ *
+ * @param buf Pointer to the buffer
+ * @param y Line to start on
+ * @param x First byte to look at
+ * @param need Number of unmatched opening brackets, at least 1
+ * @param my Receives the line of the bracket
+ * @param mx Receives its byte offset
+ * @return 1 if found, 0 otherwise
+ */
+static int bracket_forward(Buffer *buf, int y, size_t x, int need, int *my,
+                           size_t *mx);
+
+/**
+ * @brief Finds the opening bracket for unmatched closers after a position
+ *
+ * @param buf Pointer to the buffer
+ * @param y Line to start on
+ * @param x Byte to stop before on that line
+ * @param need Number of unmatched closing brackets, at least 1
+ * @param my Receives the line of the bracket
+ * @param mx Receives its byte offset
+ * @return 1 if found, 0 otherwise
+ */
+static int bracket_backward(Buffer *buf, int y, size_t x, int need, int *my,
+                            size_t *mx);
+
+/**
+ * @brief Finds the bracket matching the one at a position
+ *
+ * @param buf Pointer to the buffer
+ * @param y Line number
+ * @param x Byte offset of the bracket
+ * @param my Receives the line of the match
+ * @param mx Receives its byte offset
+ * @return 1 if found, 0 if there is no bracket at (y, x) or it is unmatched
+ */
+static int bracket_match(Buffer *buf, int y, size_t x, int *my, size_t *mx);
+
+/**
+ * @brief Moves the cursor to the matching or the enclosing bracket
+ *
+ * Matching accepts a bracket under the cursor or just before it. The
+ * enclosing bracket is the nearest unmatched opening bracket before the
+ * cursor, so repeating the jump walks outwards.
+ *
+ * @param ed Pointer to the editor state
+ * @param enclosing Non-zero to jump to the enclosing bracket
+ * @param status Buffer for a status message
+ * @param status_len Size of status
+ */
+static void bracket_jump(Editor *ed, int enclosing, char *status,
+                         size_t status_len);
+
+/**
+ * @brief Tells whether a byte can be part of a word
+ *
+ * @param ch Byte value
+ * @return Non-zero for letters, digits, '_' and bytes of UTF-8 sequences
+ */
+static int word_byte(int ch);
+
+/**
+ * @brief Looks up a word in the completion index, adding it if it is new
+ *
+ * @param ix Pointer to the word index
+ * @param text The word
+ * @param len Length of text in bytes
+ * @return Id of the word
+ */
+static uint32_t word_id(WordIndex *ix, const char *text, size_t len);
+
+/**
+ * @brief Adjusts the occurrence count of a word
+ *
+ * @param ix Pointer to the word index
+ * @param id Id of the word
+ * @param delta 1 or -1
+ */
+static void word_count(WordIndex *ix, uint32_t id, int delta);
+
+/**
+ * @brief Compares the text of two words, byte by byte
+ *
+ * @param ix Pointer to the word index
+ * @param a Id of the first word
+ * @param b Id of the second word
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int word_cmp(const WordIndex *ix, uint32_t a, uint32_t b);
+
+/**
+ * @brief Merges two runs of word ids in text order into out
+ *
+ * @param ix Pointer to the word index
+ * @param a First run
+ * @param na Length of a
+ * @param b Second run
+ * @param nb Length of b
+ * @param out Receives na + nb ids
+ */
+static void word_merge(const WordIndex *ix, const uint32_t *a, uint32_t na,
+                       const uint32_t *b, uint32_t nb, uint32_t *out);
+
+/**
+ * @brief Sorts word ids by text
+ *
+ * @param ix Pointer to the word index
+ * @param a Ids to sort
+ * @param tmp Scratch space for n ids
+ * @param n Number of ids
+ */
+static void word_run(const WordIndex *ix, uint32_t *a, uint32_t *tmp,
+                     uint32_t n);
+
+/**
+ * @brief Merges the unsorted new ids into the sorted part of the order
+ *
+ * @param ix Pointer to the word index
+ */
+static void word_sort(WordIndex *ix);
+
+/**
+ * @brief Indexes a line's words, uncounting those it was indexed with
+ *
+ * Words start with a letter, '_' or a UTF-8 byte; numbers and words longer
+ * than WORD_MAX are left out, as are words past the first WORD_LINE_MAX.
+ *
+ * @param buf Pointer to the buffer
+ * @param at Line number
+ */
+static void line_words(Buffer *buf, int at);
+
+/**
+ * @brief Uncounts and frees the word list of a line
+ *
+ * @param buf Pointer to the buffer
+ * @param info The line's metadata
+ */
+static void line_words_release(Buffer *buf, LineInfo *info);
+
+/**
+ * @brief Empties the word index and every line's word list
+ *
+ * @param buf Pointer to the buffer
+ * @param keep Non-zero to leave the index ready to be built again, zero
+ * to free it for good
+ */
+static void words_drop(Buffer *buf, int keep);
+
+/**
+ * @brief Marks the lines edited since the last damage reset for indexing
+ *
+ * @param buf Pointer to the buffer
+ */
+static void words_sync(Buffer *buf);
+
+/**
+ * @brief Indexes the lines that changed since they were last indexed
+ *
+ * Spilled lines are left out until they are edited, so building the index
+ * never reads the spill file. Lines in long_lines are left out altogether:
+ * indexing one would cost its whole length on every edit.
+ *
+ * @param buf Pointer to the buffer
+ * @param deadline Time (now_us) to stop by, or 0 to finish
+ * @return 1 if work remains, 0 when the index is up to date
+ */
+static int words_refresh(Buffer *buf, long long deadline);
+
+/**
+ * @brief Finds the most frequent words that extend a prefix
+ *
+ * @param ix Pointer to the word index
+ * @param prefix The start of the word
+ * @param n Length of prefix in bytes
+ * @param out Receives up to max ids, most frequent first
+ * @param max Capacity of out
+ * @return Number of ids stored in out
+ */
+static int word_complete(WordIndex *ix, const char *prefix, size_t n,
+                         uint32_t *out, int max);
+
+/**
+ * @brief Completes the word before the cursor from the words in the buffer
+ *
+ * Repeating it right away cycles through the other choices.
+ *
+ * @param ed Pointer to the editor state
+ * @param status Buffer for a status message
+ * @param status_len Size of status
+ */
+static void complete_word(Editor *ed, char *status, size_t status_len);
+
+/**
+ * @brief Moves the cursor (or every cursor) for an arrow key
+ *
+ * @param ed Pointer to the editor state
+ * @param key KEY_UP, KEY_DOWN, KEY_LEFT or KEY_RIGHT
+ */
+static void move_cursor(Editor *ed, int key);
+
+/**
+ * @brief Moves the cursor up or down one line, keeping its screen column
+ *
+ * @param ed Pointer to the editor state
+ * @param dir -1 to move up, 1 to move down
+ */
+static void move_vertical(Editor *ed, int dir);
+
+/**
+ * @brief Inserts bytes at the cursor position
+ *
+ * @param ed Pointer to the editor state
+ * @param text Bytes to insert
+ * @param n Number of bytes
+ */
+static void insert_text(Editor *ed, const char *text, size_t n);
+
+/**
+ * @brief Inserts a character at the cursor position
+ *
+ * Inserts a character at the current cursor location, expanding the line as
+ * needed. Handles memory reallocation and updates line length tracking.
+ *
+ * @param ed Pointer to the editor state
+ * @param ch The character to insert, as an integer
+ */
+static void insert_char(Editor *ed, int ch);
+
+/**
+ * @brief Reads the rest of a UTF-8 sequence and inserts it
+ *
+ * Invalid sequences are dropped.
+ *
+ * @param ed Pointer to the editor state
+ * @param lead The lead byte already read
+ */
+static void insert_utf8(Editor *ed, int lead);
+
+/**
+ * @brief Handles backspace (backward delete) operation
+ *
+ * Deletes the character before the cursor. If the cursor is at the beginning of
+ * a line, merges the current line with the previous line.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void backspace(Editor *ed);
+
+/**
+ * @brief Handles delete (forward delete) operation
+ *
+ * Deletes the character at the cursor. If the cursor is at the end of a line,
+ * merges the current line with the next line.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void delete_at_cursor(Editor *ed);
+
+/**
+ * @brief Inserts a newline at the cursor position, splitting the line
+ *
+ * Splits the current line at the cursor position:
+ * - The content before the cursor remains on the current line
+ * - The content after the cursor moves to a new line below
+ * - The cursor moves to the beginning of the new line
+ *
+ * @param ed Pointer to the editor state
+ */
+static void insert_newline(Editor *ed);
+
+/**
+ * @brief Returns the selected range in document order
+ *
+ * @param ed Pointer to the editor state
+ * @param y0 Receives the first line
+ * @param x0 Receives the start offset
+ * @param y1 Receives the last line
+ * @param x1 Receives the end offset
+ * @return Non-zero if a non-empty range is selected
+ */
+static int sel_range(const Editor *ed, int *y0, int *x0, int *y1, int *x1);
+
+/**
+ * @brief Shows the selected part of a screen row in reverse video
+ *
+ * @param ed Pointer to the editor state
+ * @param at Line drawn on the row
+ * @param col First column of the line shown on the row
+ * @param ncols Number of columns on the row
+ * @param row Screen row
+ */
+static void sel_highlight(Editor *ed, int at, size_t col, int ncols, int row);
+
+/**
+ * @brief Copies or cuts the selection into the clipboard
+ *
+ * @param ed Pointer to the editor state
+ * @param cut Non-zero to delete the selection as well
+ */
+static void clipboard_copy(Editor *ed, int cut);
+
+/**
+ * @brief Pastes the clipboard at the cursor
+ *
+ * @param ed Pointer to the editor state
+ */
+static void clipboard_paste(Editor *ed);
+
+/**
+ * @brief Returns the block selection's lines and screen columns
+ *
+ * @param ed Pointer to the editor state
+ * @param y0 Receives the first line
+ * @param y1 Receives the last line
+ * @param c0 Receives the first column
+ * @param c1 Receives the column just past the block
+ * @return Non-zero if a block selection is active
+ */
+static int block_range(Editor *ed, int *y0, int *y1, size_t *c0, size_t *c1);
+
+/**
+ * @brief Copies or cuts the block selection into the clipboard
+ *
+ * Each line is visited once: its slice is copied into the clip and, for a
+ * cut, removed with a single splice.
+ *
+ * @param ed Pointer to the editor state
+ * @param cut Non-zero to delete the block as well
+ */
+static void block_copy(Editor *ed, int cut);
+
+/**
+ * @brief Pastes a block clip as a rectangle at the cursor's column
+ *
+ * Row k goes into line cy + k, padded with spaces when the line is shorter
+ * than the cursor's column; missing lines are appended in one step.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void block_paste(Editor *ed);
+
+/**
+ * @brief Turns the block selection into one cursor per line at its left
+ * column, deleting the block's text first
+ *
+ * Lines that end before the left column get no cursor, except the
+ * cursor's own line.
+ *
+ * @param ed Pointer to the editor state
+ * @return Non-zero if text was deleted
+ */
+static int block_to_cursors(Editor *ed);
+
+/**
+ * @brief Sets a named mark, or toggles a bookmark, at the cursor
+ *
+ * @param ed Pointer to the editor state
+ * @param key Letter a-z for a named mark, space for a bookmark
+ */
+static void mark_set(Editor *ed, int key);
+
+/**
+ * @brief Moves the cursor to a named mark, or to the next mark
+ *
+ * @param ed Pointer to the editor state
+ * @param key Letter a-z for a named mark, space for the next mark of any
+ * kind after the cursor line (wrapping to the first)
+ */
+static void mark_jump(Editor *ed, int key);
+
+/**
+ * @brief Runs a line command on the selected lines, or the whole buffer
+ *
+ * Commands are "sort" with sort(1)-style options -n, -r, -u, -k N and
+ * -t C, "uniq", "reverse" and "!cmd" to filter through a shell command.
+ *
+ * @param ed Pointer to the editor state
+ * @param cmd Command text
+ * @param status Receives a message for the status line
+ * @param status_len Size of status
+ * @return Non-zero if the command was understood
+ */
+static int lines_command(Editor *ed, const char *cmd, char *status,
+                         size_t status_len);
+
+/**
+ * @brief Parses one ex address
+ *
+ * Addresses are a line number, '.', '$' or 'x for a named mark, followed
+ * by any number of +N and -N offsets. A bare offset counts from the
+ * cursor line.
+ *
+ * @param ed Pointer to the editor state
+ * @param s Text to parse; advanced past the address
+ * @param y Receives the 0-based line, which may be out of range
+ * @return 1 if an address was read, 0 if there is none, -1 for an unset mark
+ */
+static int ex_address(Editor *ed, char **s, int *y);
+
+/**
+ * @brief Runs an ex command line
+ *
+ * A range (%, or ADDR or ADDR,ADDR; the cursor line by default) is
+ * followed by one of:
+ * - nothing: Go to the last line of the range
+ * - d: Delete the lines
+ * - s/RE/REPL/[gi]: Substitute, all matches applied in one pass
+ * - m ADDR: Move the lines below ADDR (0 for the top)
+ * - g/RE/d, g/RE/s/RE/REPL/: Delete or substitute on matching lines (v for
+ *   lines that do not match); the range defaults to the whole buffer
+ *
+ * Each command is one bulk operation on the buffer: a global delete keeps
+ * the surviving lines in a single pass over the line arrays.
+ *
+ * @param ed Pointer to the editor state
+ * @param cmd Command text, with or without the leading ':'
+ * @param status Receives a message for the status line
+ * @param status_len Size of status
+ * @return Non-zero if the command ran
+ */
+static int ex_command(Editor *ed, const char *cmd, char *status,
+                      size_t status_len);
+
+/**
+ * @brief Orders carets by line, then by byte offset
+ *
+ * @param a First Caret
+ * @param b Second Caret
+ * @return Negative, zero or positive, as for qsort
+ */
+static int caret_cmp(const void *a, const void *b);
+
+/**
+ * @brief Sorts the cursors, drops duplicates and re-finds the primary one
+ *
+ * Editor.cursor is updated to the primary cursor.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void multi_normalize(Editor *ed);
+
+/**
+ * @brief Prepares the cursors for an edit, taking in primary cursor moves
+ *
+ * @param ed Pointer to the editor state
+ */
+static void multi_begin(Editor *ed);
+
+/**
+ * @brief Normalizes the cursors after an edit or move, leaving multi-cursor
+ * mode once they have all merged into one
+ *
+ * @param ed Pointer to the editor state
+ */
+static void multi_settle(Editor *ed);
+
+/**
+ * @brief Appends a cursor; multi_normalize restores the order
+ *
+ * @param ed Pointer to the editor state
+ * @param y Line index
+ * @param x Byte offset
+ */
+static void multi_push(Editor *ed, int y, int x);
+
+/**
+ * @brief Adds cursors at the primary cursor's column
+ *
+ * With a selection, puts a cursor on every selected line; otherwise adds
+ * one on the line below the last cursor.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void multi_add(Editor *ed);
+
+/**
+ * @brief Drops all cursors but the primary one
+ *
+ * @param ed Pointer to the editor state
+ */
+static void multi_clear(Editor *ed);
+
+/**
+ * @brief Inserts text at every cursor
+ *
+ * @param ed Pointer to the editor state
+ * @param text Bytes to insert
+ * @param n Number of bytes
+ */
+static void multi_insert(Editor *ed, const char *text, size_t n);
+
+/**
+ * @brief Deletes one character at every cursor
+ *
+ * Cursors at a line boundary join the lines, all in one pass.
+ *
+ * @param ed Pointer to the editor state
+ * @param dir -1 to delete before the cursors (Backspace), 1 after (Delete)
+ */
+static void multi_erase(Editor *ed, int dir);
+
+/**
+ * @brief Joins lines onto their predecessors in one pass
+ *
+ * @param ed Pointer to the editor state
+ * @param joins Lines to append to the line above, increasing and unique
+ * @param nj Number of lines in joins
+ */
+static void multi_join(Editor *ed, const int *joins, int nj);
+
+/**
+ * @brief Splits the line at every cursor in one pass
+ *
+ * @param ed Pointer to the editor state
+ */
+static void multi_newline(Editor *ed);
+
+/**
+ * @brief Moves every cursor for an arrow key
+ *
+ * @param ed Pointer to the editor state
+ * @param key KEY_UP, KEY_DOWN, KEY_LEFT or KEY_RIGHT
+ */
+static void multi_move(Editor *ed, int key);
+
+/**
+ * @brief Marks the secondary cursors on a range of lines
+ *
+ * @param ed Pointer to the editor state
+ * @param lo First line on screen
+ * @param hi Last line on screen
+ */
+static void multi_draw(Editor *ed, int lo, int hi);
+
+/**
+ * @brief Appends a copy of a line to the end of the buffer
+ *
+ * The copy stops at the first embedded NUL byte, if any.
+ *
+ * @param buf Pointer to the buffer
+ * @param text Start of the line text (need not be NUL-terminated)
+ * @param len Number of bytes in the line, excluding the newline
+ */
+static void buffer_append_line(Buffer *buf, const char *text, size_t len);
+
+/**
+ * @brief Computes the sampled content hash used in the line index key
+ *
+ * Hashes the file size and LINEIDX_SAMPLES evenly spaced blocks of the file,
+ * so that in-place rewrites which preserve size and mtime are still noticed
+ * without reading the whole file.
+ *
+ * @param map The mapped file contents
+ * @param size Size of the mapping in bytes
+ * @return 64-bit FNV-1a hash of the samples
+ */
+static uint64_t lineidx_sample_hash(const char *map, size_t size);
+
+/**
+ * @brief Builds the cache path for a file's line index
+ *
+ * @param st Stat of the indexed file
+ * @param out Output buffer for the path
+ * @param out_len Size of the output buffer
+ * @param create Non-zero to create the cache directory if needed
+ * @return 1 on success, 0 if no cache directory is available
+ */
+static int lineidx_path(const struct stat *st, char *out, size_t out_len,
+                        int create);
+
+/**
+ * @brief Fills in the key fields of a line index header
+ *
+ * @param hdr Header to fill; num_lines and payload_len are zeroed
+ * @param st Stat of the indexed file
+ * @param map The mapped file contents
+ * @param size Size of the mapping in bytes
+ */
+static void lineidx_fill_header(LineIndexHeader *hdr, const struct stat *st,
+                                const char *map, size_t size);
+
+/**
+ * @brief Loads the buffer using a cached line index
+ *
+ * Maps the sidecar index, validates its key against the file and decodes the
+ * line lengths into the buffer instead of searching for newlines. Each line
+ * is still copied, classified and hashed, and that dominates: the newline
+ * search is a small part of a load, so a hit saves little time. An index
+ * whose key does not match is deleted; one that is used has its
+ * modification time renewed.
+ *
+ * @param buf Empty buffer to fill
+ * @param st Stat of the file being loaded
+ * @param map The mapped file contents
+ * @param size Size of the mapping in bytes
+ * @return 1 if the buffer was filled, 0 if the cache is missing or stale
+ */
+static int lineidx_load(Buffer *buf, const struct stat *st, const char *map,
+                        size_t size);
+
+/**
+ * @brief Writes a line index sidecar for a file
+ *
+ * The index is written to a temporary file and renamed into place, and
+ * then indexes unused for LINEIDX_MAX_AGE are pruned. Failures are silently
+ * ignored since the cache is only an optimization.
+ *
+ * @param st Stat of the indexed file
+ * @param map The mapped file contents
+ * @param size Size of the mapping in bytes
+ * @param payload Encoded varint line lengths
+ * @param payload_len Length of the payload in bytes
+ * @param num_lines Number of varints in the payload
+ */
+static void lineidx_store(const struct stat *st, const char *map, size_t size,
+                          const unsigned char *payload, size_t payload_len,
+                          uint64_t num_lines);
+
+/**
+ * @brief Deletes line indexes and stray temporary files that have gone
+ * unused for LINEIDX_MAX_AGE
+ *
+ * @param dir The cache directory
+ */
+static void lineidx_prune(const char *dir);
+
+/**
+ * @brief Fills the buffer by scanning the mapped file for newlines
+ *
+ * If store is set, for files of at least LINEIDX_MIN_SIZE bytes the line
+ * lengths are encoded while scanning and stored as a line index sidecar for
+ * the next open.
+ *
+ * @param buf Empty buffer to fill
+ * @param st Stat of the file being loaded
+ * @param map The mapped file contents
+ * @param size Size of the mapping in bytes
+ * @param store Non-zero to write a line index sidecar
+ */
+static void scan_lines(Buffer *buf, const struct stat *st, const char *map,
+                       size_t size, int store);
+
+/**
+ * @brief Fills an empty buffer from a mapped file
+ *
+ * Uses the cached line index when it is valid and falls back to scan_lines
+ * otherwise.
+ *
+ * @param buf Empty buffer to fill
+ * @param st Stat of the mapped file
+ * @param map The mapped file contents
+ * @param size Size of the mapping in bytes (must be non-zero)
+ * @param store Non-zero to write a line index sidecar after a scan
+ */
+static void buffer_load_map(Buffer *buf, const struct stat *st,
+                            const char *map, size_t size, int store);
+
+/**
+ * @brief Loads a file into the editor buffer
+ *
+ * Maps the file and splits it into lines, storing each line in the buffer.
+ * Large files reuse a cached line index when one is valid.
+ * Initializes the cursor and viewport to the beginning of the file.
+ * If the file is empty, creates a single empty line.
+ *
+ * @param ed Pointer to the editor state
+ * @param filename Path to the file to load
+ * @param store Non-zero to write a line index sidecar for a large file;
+ * only interactive opens do, so batch runs leave the cache alone
+ * @return 1 on success, 0 on failure (file not found or I/O error)
+ */
+static int load_file(Editor *ed, const char *filename, int store);
+
+/**
+ * @brief Reads a line of input on the status line
+ *
+ * Accepts printable ASCII characters and backspace.
+ *
+ * @param label Text shown before the input
+ * @param out Output buffer, always NUL-terminated
+ * @param out_len Size of the output buffer
+ * @return 1 if confirmed with Enter, 0 if cancelled with Esc
+ */
+static int prompt(const char *label, char *out, size_t out_len);
+
+/**
+ * @brief Opens a file in the read-only pager
+ *
+ * Maps the file without reading it and switches the editor to MODE_PAGER.
+ *
+ * @param ed Pointer to the editor state
+ * @param filename Path to the file to view
+ * @return 1 on success, 0 on failure
+ */
+static int pager_open(Editor *ed, const char *filename);
+
+/**
+ * @brief Unmaps the file and frees the checkpoint array
+ *
+ * @param p Pointer to the pager
+ */
+static void pager_close(Pager *p);
+
+/**
+ * @brief Finds the start of the line containing a byte
+ *
+ * @param p Pointer to the pager
+ * @param off Byte offset inside the line (less than the file size)
+ * @return Byte offset of the line start
+ */
+static size_t pager_line_start(const Pager *p, size_t off);
+
+/**
+ * @brief Finds the start of the line after the one starting at off
+ *
+ * @param p Pointer to the pager
+ * @param off Byte offset of a line start
+ * @return Byte offset of the next line, or the file size at the last line
+ */
+static size_t pager_next(const Pager *p, size_t off);
+
+/**
+ * @brief Advances the scan frontier until a line number is reached
+ *
+ * Records a checkpoint every PAGER_CHECKPOINT lines and releases the pages
+ * the scan touched, apart from the last PAGER_KEEP_BYTES.
+ *
+ * @param p Pointer to the pager
+ * @param line Line number the frontier should reach
+ */
+static void pager_extend(Pager *p, long line);
+
+/**
+ * @brief Scrolls the pager viewport by a number of lines
+ *
+ * @param p Pointer to the pager
+ * @param delta Lines to scroll; negative scrolls up
+ */
+static void pager_scroll(Pager *p, int delta);
+
+/**
+ * @brief Moves the viewport to a line number
+ *
+ * Seeks from the nearest checkpoint, scanning further only if the line lies
+ * beyond the frontier. Lines past the end stop on the last line.
+ *
+ * @param p Pointer to the pager
+ * @param line Zero-based line number
+ */
+static void pager_goto_line(Pager *p, long line);
+
+/**
+ * @brief Moves the viewport to the last screenful of the file
+ *
+ * @param p Pointer to the pager
+ */
+static void pager_goto_end(Pager *p);
+
+/**
+ * @brief Draws the pager viewport and status line
+ *
+ * Only the visible columns of each line are examined. Rows are drawn with
+ * the same tab, control character and UTF-8 rules as the edit view.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void pager_redraw(const Editor *ed);
+
+/**
+ * @brief Handles a key press in the pager
+ *
+ * Key bindings:
+ * - Up/Down, k/j: Scroll one line
+ * - PgUp/PgDn, b/Space: Scroll one screen
+ * - Left/Right: Scroll horizontally
+ * - Home/End, g/G: Go to start/end of file
+ * - ':': Go to line number
+ * - e: Switch to edit mode
+ * - q: Quit
+ *
+ * @param ed Pointer to the editor state
+ * @param ch The key pressed
+ * @return 0 if the editor should quit, 1 otherwise
+ */
+static int pager_handle_key(Editor *ed, int ch);
+
+/**
+ * @brief Switches from the pager to edit mode
+ *
+ * Builds the buffer from the existing mapping, then places the cursor on the
+ * line at the top of the pager viewport and releases the pager.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void pager_upgrade(Editor *ed);
+
+/**
+ * @brief Opens a file in the hex view
+ *
+ * Maps the file and switches the editor to MODE_HEX. The file is opened
+ * read-write when possible so saves can patch it in place.
+ *
+ * @param ed Pointer to the editor state
+ * @param filename Path to the file to view
+ * @return 1 on success, 0 on failure
+ */
+static int hex_open(Editor *ed, const char *filename);
+
+/**
+ * @brief Unmaps the file and discards unsaved overwrites
+ *
+ * @param h Pointer to the hex view
+ */
+static void hex_close(HexView *h);
+
+/**
+ * @brief Finds where an offset is or would be in the patch overlay
+ *
+ * @param h Pointer to the hex view
+ * @param off Byte offset to look up
+ * @return Index of the first patch with an offset not less than off
+ */
+static size_t hex_find_patch(const HexView *h, size_t off);
+
+/**
+ * @brief Reads a byte through the patch overlay
+ *
+ * @param h Pointer to the hex view
+ * @param off Byte offset (less than the file size)
+ * @param patched If non-NULL, set to 1 when the byte has been overwritten
+ * @return The current value of the byte
+ */
+static int hex_byte(const HexView *h, size_t off, int *patched);
+
+/**
+ * @brief Records an overwrite of one byte in the patch overlay
+ *
+ * @param h Pointer to the hex view
+ * @param off Byte offset (less than the file size)
+ * @param byte New value of the byte
+ */
+static void hex_set_byte(HexView *h, size_t off, unsigned char byte);
+
+/**
+ * @brief Writes all overwritten bytes back into the file in place
+ *
+ * Consecutive patches are coalesced into a single pwrite. The overlay is
+ * cleared on success.
+ *
+ * @param h Pointer to the hex view
+ * @return 1 on success, 0 on failure (I/O error or read-only file)
+ */
+static int hex_save(HexView *h);
+
+/**
+ * @brief Draws the visible hex rows and the status line
+ *
+ * Overwritten bytes are shown in bold.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void hex_redraw(const Editor *ed);
+
+/**
+ * @brief Handles a key press in the hex view
+ *
+ * Key bindings:
+ * - Arrow keys, PgUp/PgDn, Home/End: Move the cursor
+ * - Tab: Switch between the hex and ASCII panes
+ * - Hex digits (hex pane) / printable characters (ASCII pane): Overwrite
+ * - Ctrl+S / Ctrl+W: Write overwrites to the file
+ *
+ * @param ed Pointer to the editor state
+ * @param ch The key pressed
+ */
+static void hex_handle_key(Editor *ed, int ch);
+
+
+/**
+ * @brief Returns the text of a line on either side of the diff
+ *
+ * @param ed Pointer to the editor state
+ * @param side 0 for the disk copy, 1 for the buffer
+ * @param at Line number on that side
+ * @param len Receives the length in bytes
+ * @return The text; not NUL-terminated on the disk side
+ */
+static const char *diff_line(Editor *ed, int side, int at, size_t *len);
+
+/**
+ * @brief Compares a disk line with a buffer line
+ *
+ * @param ed Pointer to the editor state
+ * @param a Disk line
+ * @param b Buffer line
+ * @return Non-zero if the texts are equal
+ */
+static int diff_same(Editor *ed, int a, int b);
+
+/**
+ * @brief Numbers lines so that equal texts get equal numbers
+ *
+ * Disk lines lo..lo+na-1 become numbers 0..na-1 and buffer lines
+ * lo..lo+nb-1 numbers na..na+nb-1, each line taking the number of the
+ * first line with the same text. Texts are hashed once and compared only
+ * when hashes match.
+ *
+ * @param ed Pointer to the editor state
+ * @param lo First line of the compared range on both sides
+ * @param na Disk lines in the range
+ * @param nb Buffer lines in the range
+ * @param ids Receives na + nb numbers
+ */
+static void diff_intern(Editor *ed, int lo, int na, int nb, int *ids);
+
+/**
+ * @brief Marks the lines of a range of the search as changed
+ *
+ * @param c Diff state
+ * @param a0 First old entry
+ * @param a1 One past the last old entry
+ * @param b0 First new entry
+ * @param b1 One past the last new entry
+ */
+static void diff_mark(DiffCtx *c, int a0, int a1, int b0, int b1);
+
+/**
+ * @brief Builds the hunks from per-line change marks
+ *
+ * @param d Pointer to the diff view; hunks are appended
+ * @param ca Per disk line of the compared range, non-zero if removed
+ * @param cb Per buffer line of the compared range, non-zero if added
+ * @param na Disk lines in the range
+ * @param nb Buffer lines in the range
+ * @param lo First line of the range on both sides
+ */
+static void diff_hunks(DiffView *d, const char *ca, const char *cb, int na,
+                       int nb, int lo);
+
+/**
+ * @brief Finds the middle snake of a range of the edit graph
+ *
+ * Searches forward from the top-left and backward from the bottom-right
+ * corner until the paths overlap, in O(N + M) space. Past max_cost steps
+ * the best point reached so far is taken instead, bounding the time on
+ * very different inputs at the price of a slightly longer diff.
+ *
+ * @param c Diff state
+ * @param xoff First old line
+ * @param xlim One past the last old line
+ * @param yoff First new line
+ * @param ylim One past the last new line
+ * @param xmid Receives the old line to split at
+ * @param ymid Receives the new line to split at
+ */
+static void diff_split(DiffCtx *c, int xoff, int xlim, int yoff, int ylim,
+                       int *xmid, int *ymid);
+
+/**
+ * @brief Diffs a range by splitting at middle snakes
+ *
+ * @param c Diff state
+ * @param a0 First old line
+ * @param a1 One past the last old line
+ * @param b0 First new line
+ * @param b1 One past the last new line
+ */
+static void diff_compare(DiffCtx *c, int a0, int a1, int b0, int b1);
+
+/**
+ * @brief Assigns a starting row to each hunk for the current layout
+ *
+ * @param d Pointer to the diff view
+ */
+static void diff_layout(DiffView *d);
+
+/**
+ * @brief Finds the lines shown on a row of the diff view
+ *
+ * @param d Pointer to the diff view
+ * @param row Row in the current layout
+ * @param a Receives the disk line, or -1 if the row has none
+ * @param b Receives the buffer line, or -1 if the row has none
+ * @return Index of the hunk the row belongs to, or -1 for unchanged lines
+ */
+static int diff_row(const DiffView *d, long row, int *a, int *b);
+
+/**
+ * @brief Compares the buffer with its file on disk and opens the diff view
+ *
+ * Unchanged leading and trailing lines are skipped by direct comparison;
+ * the rest is numbered with diff_intern and diffed with Myers' algorithm,
+ * leaving out lines that only one side has.
+ *
+ * @param ed Pointer to the editor state
+ * @param status Receives a message when the view is not opened
+ * @param status_len Size of status
+ * @return 1 if the view was opened, 0 on error or when nothing changed
+ */
+static int diff_open(Editor *ed, char *status, size_t status_len);
+
+/**
+ * @brief Releases the diff view
+ *
+ * @param d Pointer to the diff view
+ */
+static void diff_close(DiffView *d);
+
+/**
+ * @brief Draws one side of a diff row
+ *
+ * @param ed Pointer to the editor state
+ * @param side 0 for the disk copy, 1 for the buffer
+ * @param at Line on that side, or -1 to draw nothing
+ * @param row Screen row
+ * @param x Screen column to start at
+ * @param width Columns available
+ * @param attr Attributes for the text
+ */
+static void diff_draw(Editor *ed, int side, int at, int row, int x, int width,
+                      int attr);
+
+/**
+ * @brief Draws the diff view and its status line
+ *
+ * Inline, removed disk lines are marked '-' and added buffer lines '+'.
+ * Side by side, the disk copy is on the left and changed rows are marked
+ * in the middle.
+ *
+ * @param ed Pointer to the editor state
+ */
+static void diff_redraw(Editor *ed);
+
+/**
+ * @brief Handles a key press in the diff view
+ *
+ * Key bindings:
+ * - Up/Down, k/j: Scroll one row
+ * - PgUp/PgDn, b/Space: Scroll one screen
+ * - Left/Right: Scroll horizontally
+ * - Home/End, g/G: Go to the start/end
+ * - n/p: Next/previous hunk
+ * - s: Toggle side by side and inline
+ * - Enter: Back to editing, at the hunk on screen
+ * - q, Ctrl+D: Back to editing
+ *
+ * @param ed Pointer to the editor state
+ * @param ch Key code
+ * @return 0 to leave the view, 1 otherwise
+ */
+static int diff_handle_key(Editor *ed, int ch);
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return Current time in microseconds
+ */
+static long long now_us(void);
+
+/**
+ * @brief Idle task: extends the pager's checkpoint scan to the end of file
+ *
+ * When the scan completes, the viewport's line number is resolved if it was
+ * unknown and a redraw is requested.
+ *
+ * @param ed Pointer to the editor state
+ * @param deadline Time (now_us) by which the slice should end
+ * @return 1 if work remains, 0 when finished
+ */
+static int idle_pager_scan(Editor *ed, long long deadline);
+
+/**
+ * @brief Idle task: prepares render rows and column maps near the viewport
+ *
+ * Covers one screen above the viewport and IDLE_WARM_SCREENS below, so
+ * scrolling onto those lines does not have to build their layout.
+ *
+ * @param ed Pointer to the editor state
+ * @param deadline Time (now_us) by which the slice should end
+ * @return 1 if work remains, 0 when finished
+ */
+static int idle_warm_layout(Editor *ed, long long deadline);
+
+/**
+ * @brief Idle task: compacts line storage after a long run of edits
+ *
+ * A pass starts once IDLE_COMPACT_EDITS edits have accumulated, shrinks
+ * every line and the per-line arrays, then returns free heap memory to the
+ * OS and reports the bytes reclaimed on the status line.
+ *
+ * @param ed Pointer to the editor state
+ * @param deadline Time (now_us) by which the slice should end
+ * @return 1 if work remains, 0 when finished
+ */
+static int idle_compact(Editor *ed, long long deadline);
+
+/**
+ * @brief Idle task: brings the buffer digest up to date after edits
+ *
+ * Recomputes the stale leaves of the digest tree in slices; edits made
+ * meanwhile only add to what is stale. Once the digest is known a redraw
+ * is requested, which clears the modified indicator if the edits turned
+ * out to cancel out.
+ *
+ * @param ed Pointer to the editor state
+ * @param deadline Time (now_us) by which the slice should end
+ * @return 1 if work remains, 0 when finished
+ */
+static int idle_digest(Editor *ed, long long deadline);
+
+/**
+ * @brief Idle task: keeps the bracket index up to date
+ *
+ * Builds the index after loading and recomputes the leaves dirtied by edits,
+ * so bracket jumps rarely have to wait for it.
+ *
+ * @param ed Pointer to the editor state
+ * @param deadline Time (now_us) by which the slice should end
+ * @return 1 if work remains, 0 when finished
+ */
+static int idle_brackets(Editor *ed, long long deadline);
+
+/**
+ * @brief Idle task: keeps the word index for completion up to date
+ *
+ * @param ed Pointer to the editor state
+ * @param deadline Time (now_us) by which the slice should end
+ * @return 1 if work remains, 0 when finished
+ */
+static int idle_words(Editor *ed, long long deadline);
+
+/**
+ * @brief Checks whether terminal input is waiting without blocking
+ *
+ * @return Non-zero if a read from stdin would not block
+ */
+static int input_pending(void);
+
+/**
+ * @brief Runs one slice of the next idle task with work left
+ *
+ * @param ed Pointer to the editor state
+ * @return 1 if a slice ran, 0 if no task has work
+ */
+static int idle_step(Editor *ed);
+
+/**
+ * @brief Redraws whichever view is active
+ *
+ * @param ed Pointer to the editor state
+ */
+static void redraw_view(Editor *ed);
+
+/**
+ * @brief Waits for the next key, running idle tasks in the meantime
+ *
+ * Every task is re-armed on each call. Slices last at most IDLE_SLICE_US and
+ * input is polled between them, so a key press preempts idle work within
+ * about a millisecond.
+ *
+ * @param ed Pointer to the editor state
+ * @return The key read with getch()
+ */
+static int idle_wait_key(Editor *ed);
+
+/**
+ * @brief Decodes \n, \t and \\ escapes of script text in place
+ *
+ * @param s NUL-terminated text
+ * @return Length of the decoded text
+ */
+static size_t batch_unescape(char *s);
+
+/**
+ * @brief Parses one script line into a command
+ *
+ * @param text Script line, modified in place
+ * @param cmd Receives the command
+ * @param err Receives a message on failure
+ * @param err_len Size of err
+ * @return 1 on success, 0 on a syntax error
+ */
+static int batch_parse(char *text, BatchCmd *cmd, char *err, size_t err_len);
+
+/**
+ * @brief Runs parsed script commands against the loaded buffer
+ *
+ * @param ed Pointer to the editor state
+ * @param cmds Commands
+ * @param n Number of commands
+ * @param err Receives a message on failure
+ * @param err_len Size of err
+ * @return 1 on success, 0 if a command failed
+ */
+static int batch_run(Editor *ed, const BatchCmd *cmds, int n, char *err,
+                     size_t err_len);
+
+/**
+ * @brief Applies an edit script to files without a terminal
+ *
+ * The script is read and parsed once. Each file is loaded, edited, saved
+ * if anything changed, and freed before the next, so memory stays bounded
+ * by the largest file. Errors are reported on stderr.
+ *
+ * Script lines (blank lines and lines starting with # are skipped):
+ * - goto LINE [COL]: Move to a 1-based line ($ for the last) and column
+ * - insert TEXT: Insert TEXT at the cursor and move past it
+ * - delete N: Delete N bytes after the cursor, a line break counting one
+ * - replace N TEXT: Delete N bytes, then insert TEXT
+ * - s/RE/REPL/[gi]: Substitute an extended regex on every line
+ * - sort ..., uniq, reverse, !cmd: Line commands over the whole file
+ * - :CMD: An ex command (see ex_command)
+ *
+ * TEXT takes \n, \t and \\ escapes. Any character may delimit s.
+ *
+ * @param script Path of the script
+ * @param files Paths of the files to edit
+ * @param num_files Number of files
+ * @return Exit status: 0 if every file was edited, 1 otherwise
+ */
+static int batch_main(const char *script, char **files, int num_files);
+
+/**
+ * @brief Main entry point for the text editor
+ *
+ * Initializes ncurses, loads the file, and runs the main event loop.
+ * Handles all user input and coordinates editor operations.
+ *
+ * Usage: ./editor [-R | -x] <filename>
+ *        ./editor -b <script> <filename>...
  *
- * Usage: ./editor <filename>
+ * With -R the file is opened in the read-only pager (see pager_handle_key).
+ * With -x the file is opened in the hex view (see hex_handle_key).
+ * With -b the script is applied to each file without starting ncurses
+ * (see batch_main).
  *
  * Key bindings:
  * - Arrow keys: Move cursor
  * - Ctrl+S / Ctrl+W: Save file
+ * - Ctrl+L: Toggle soft wrap
+ * - Ctrl+G: Show the memory report
+ * - Ctrl+Space: Set or clear the selection mark
+ * - Ctrl+B: Start a block selection, or switch the selection to a block
+ * - Ctrl+C / Ctrl+X / Ctrl+V: Copy, cut and paste the selection
+ * - Ctrl+N: Add a cursor below the last one, or one on each selected line
+ * - Ctrl+K then a-z: Set a named mark; Ctrl+K then Space: Toggle a bookmark
+ * - Ctrl+R then a-z: Jump to a named mark; Ctrl+R then Space: Next mark
+ * - Ctrl+T: Sort, uniq, reverse or !filter the selected lines (or all)
+ * - Ctrl+E: Ex command line (see ex_command)
+ * - Ctrl+D: Diff against the file on disk (see diff_handle_key)
+ * - Ctrl+F: Fold or unfold at the cursor
+ * - Ctrl+]: Jump to the matching bracket
+ * - Ctrl+U: Jump to the enclosing opening bracket
+ * - Ctrl+P: Complete the word before the cursor; again for the next choice
+ * - Ctrl+O: Go back to a single cursor
  * - Backspace / Delete: Delete characters
  * - Enter: Insert newline
- * - Printable characters: Insert character
- * - Esc: Exit editor
+ * - Printable characters (including UTF-8): Insert character
+ * - Esc: Exit editor (twice if there are unsaved changes)
  *
  * @param argc Number of command line arguments
  * @param argv Command line arguments (expects filename)
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Batch substitutions whose edits chain through the same line, some of
+# them splitting it, checked against sed -E.
+# Usage: tests/apply.sh [editor binary]
+ed=${1:-./main}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for i in $(seq 1 300); do
+  printf 'a,b,,c%s\n\n,\nx,y,z,\n' "$i"
+done >"$dir/in"
+
+status=0
+check() {
+  printf '%s\n' "$1" >"$dir/script"
+  cp "$dir/in" "$dir/out"
+  "$ed" -b "$dir/script" "$dir/out" || { status=1; return; }
+  sed -E "$1" "$dir/in" >"$dir/want"
+  cmp -s "$dir/out" "$dir/want" ||
+    { printf "apply: %s differs\n" "$1"; status=1; }
+}
+
+# Several matches per line, replacements that add and remove line breaks,
+# and empty matches next to real ones
+check 's/,/\n/g'
+check 's/(.),(.)/\2\n\1/g'
+check 's/,|$/<&>/g'
+check 's/b*/X/g'
+check 's/[^,]*/(&)/g'
+check 's/$/\n/g'
+
+# A replacement across line breaks, counted in bytes
+printf 'goto 1 3\nreplace 20 ZZ\\n\n' >"$dir/script"
+cp "$dir/in" "$dir/out"
+"$ed" -b "$dir/script" "$dir/out" || status=1
+{ head -c 2 "$dir/in"; printf 'ZZ\n'; tail -c +23 "$dir/in"; } >"$dir/want"
+cmp -s "$dir/out" "$dir/want" || { echo "apply: replace differs"; status=1; }
+
+[ $status = 0 ] && echo "apply: ok"
+exit $status
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Batch edits of lines past LONGLINE_MIN, checked against sed and sort.
+# Usage: tests/longline.sh [editor binary]
+ed=${1:-./main}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Eight 300 KB lines of rotated "abc" after enough short lines to keep
+# them out of the hot window around the cursor, which never spills
+seq -w 0 9999 >"$dir/in"
+abc=$(yes abc | head -n 100000 | tr -d '\n')
+for l in 1 2 3 1 2 3 1 2; do
+  printf '%s\n' "$abc" | cut -c"$l"-
+done >>"$dir/in"
+
+printf 's/ab/ba/g\n:g/^c/d\nsort\ns/$/!/\n' >"$dir/script"
+cp "$dir/in" "$dir/out"
+"$ed" -b "$dir/script" "$dir/out" || exit 1
+
+sed 's/ab/ba/g' "$dir/in" | sed '/^c/d' | LC_ALL=C sort | sed 's/$/!/' \
+  >"$dir/want"
+cmp -s "$dir/out" "$dir/want" || { echo "longline: output differs"; exit 1; }
+
+# The same with a heap budget small enough that the lines spill
+cp "$dir/in" "$dir/out"
+TEXT_EDITOR_MEM_LIMIT=1 "$ed" -b "$dir/script" "$dir/out" || exit 1
+cmp -s "$dir/out" "$dir/want" ||
+  { echo "longline: spilled output differs"; exit 1; }
+echo "longline: ok"
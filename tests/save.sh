@@ -0,0 +1,42 @@
+#!/bin/sh
+# Saves that rewrite only the lines after the first change, checked
+# against sed. A tail that gets shorter must be truncated.
+# Usage: tests/save.sh [editor binary]
+ed=${1:-./main}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+seq 1 20000 | sed 's/$/ line of text/' >"$dir/in"
+
+status=0
+check() {
+  printf '%s\n' "$1" >"$dir/script"
+  cp "$dir/in" "$dir/out"
+  "$ed" -b "$dir/script" "$dir/out" || { status=1; return; }
+  sed -E "$1" "$dir/in" >"$dir/want"
+  cmp -s "$dir/out" "$dir/want" ||
+    { printf "save: %s differs\n" "$1"; status=1; }
+}
+
+# Shorter, longer and unchanged tails after an unchanged head
+check 's/^(199[0-9][0-9]) line of text$/\1/'
+check 's/^(19999) (.*)/\1\n\2\n\2/'
+check 's/^(10000) line/\1 LINE/'
+check 's/^(15000) line of text$/\1/'
+
+# Deleting the last lines leaves only the head
+printf 'goto 19990\ndelete 999999\n' >"$dir/script"
+cp "$dir/in" "$dir/out"
+"$ed" -b "$dir/script" "$dir/out" || status=1
+{ head -n 19989 "$dir/in"; echo; } >"$dir/want"
+cmp -s "$dir/out" "$dir/want" || { echo "save: delete differs"; status=1; }
+
+# A file without a final newline is written out whole, with one
+printf 'one\ntwo' >"$dir/out"
+printf 's/two/2/\n' >"$dir/script"
+"$ed" -b "$dir/script" "$dir/out" || status=1
+printf 'one\n2\n' | cmp -s - "$dir/out" ||
+  { echo "save: missing newline differs"; status=1; }
+
+[ $status = 0 ] && echo "save: ok"
+exit $status
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Line index sidecars: an interactive open writes one, a batch run reuses
+# it, and a stale or damaged one is deleted and the file scanned instead.
+# Needs script(1) from util-linux for the interactive open.
+# Usage: tests/sidecar.sh [editor binary]
+ed=${1:-./main}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+XDG_CACHE_HOME=$dir/cache
+export XDG_CACHE_HOME
+cache=$XDG_CACHE_HOME/text_editor
+
+# Open and quit with Escape, as a user would
+open_file() {
+  (sleep 1; printf '\033') |
+    TERM=xterm ESCDELAY=10 script -qec "$ed $1" /dev/null >/dev/null
+}
+
+# Runs a substitution in batch mode and compares the file with sed's
+run() {
+  printf '%s\n' "$1" >"$dir/script"
+  sed -E "$1" "$dir/in" >"$dir/want"
+  "$ed" -b "$dir/script" "$dir/in" || exit 1
+  cmp -s "$dir/in" "$dir/want" ||
+    { printf 'sidecar: %s differs (%s)\n' "$1" "$2"; exit 1; }
+}
+
+# Over LINEIDX_MIN_SIZE, so the index is worth caching
+seq 1 100000 | sed 's/$/ line of text/' >"$dir/in"
+
+# Batch runs never write a sidecar
+run 's/^(1) line/\1 LINE/' "no sidecar"
+[ -d "$cache" ] && { echo "sidecar: batch run wrote a sidecar"; exit 1; }
+
+open_file "$dir/in"
+set -- "$cache"/*.idx
+[ -f "$1" ] || { echo "sidecar: interactive open wrote no sidecar"; exit 1; }
+idx=$1
+
+# A hit marks the sidecar as used; the save then leaves it stale
+touch -d '2000-01-01' "$idx"
+touch -d '2001-01-01' "$dir/mark"
+run 's/^(50000) line/\1 LINE/' "hit"
+[ -f "$idx" ] && [ "$idx" -nt "$dir/mark" ] ||
+  { echo "sidecar: hit did not refresh the sidecar"; exit 1; }
+
+# The file changed since the sidecar was written
+run 's/^(60000) line/\1 LINE/' "stale"
+[ -f "$idx" ] && { echo "sidecar: stale sidecar kept"; exit 1; }
+
+# A sidecar that matches the file but is cut short
+open_file "$dir/in"
+[ -f "$idx" ] || { echo "sidecar: no sidecar after reopening"; exit 1; }
+size=$(wc -c <"$idx")
+truncate -s $((size / 2)) "$idx"
+run 's/^(70000) line/\1 LINE/' "damaged"
+[ -f "$idx" ] && { echo "sidecar: damaged sidecar kept"; exit 1; }
+
+echo "sidecar: ok"
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Batch edits under a heap budget small enough that most lines spill,
+# checked against the same edits made with sed and sort.
+# Usage: tests/spill.sh [editor binary]
+ed=${1:-./main}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# Short lines, every one twice, with lines on either side of a spill block
+# (64 KiB) in the middle, one of them split so a join rebuilds it
+seq 1 10000 | sed 's/$/ some text/' >"$dir/in"
+seq 1 10000 | sed 's/$/ some text/' >>"$dir/in"
+for n in 65535 65536 65537 40000 40000; do
+  head -c "$n" /dev/zero | tr '\0' x
+  echo
+done >>"$dir/in"
+seq 10001 20000 | sed 's/$/ more text/' >>"$dir/in"
+
+printf '%s\n' 's/text/TEXT/' 'goto 20004 999999' 'delete 1' sort uniq \
+  >"$dir/script"
+cp "$dir/in" "$dir/out"
+TEXT_EDITOR_MEM_LIMIT=1 "$ed" -b "$dir/script" "$dir/out" || exit 1
+
+sed 's/text/TEXT/' "$dir/in" | sed '20004{N;s/\n//;}' | LC_ALL=C sort -u \
+  >"$dir/want"
+cmp -s "$dir/out" "$dir/want" || { echo "spill: output differs"; exit 1; }
+echo "spill: ok"